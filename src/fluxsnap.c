@@ -1,29 +1,63 @@
+#define _DEFAULT_SOURCE
+
 #include <X11/XKBlib.h>
 #include <X11/Xatom.h>
 #include <X11/Xlib.h>
+#include <X11/Xutil.h>
 #include <X11/keysym.h>
 #ifdef HAVE_XINERAMA
 #include <X11/extensions/Xinerama.h>
 #endif
+#ifdef HAVE_XRANDR
+#include <X11/extensions/Xrandr.h>
+#endif
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
-#include <sys/param.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #define DEFAULT_GAP 10
+#define DEFAULT_MIN_CELL 64
+#define DEFAULT_TITLE_HEIGHT 24
+#define STACK_MAX_DEPTH 8
+#define HIT_GRID 16
+#define PREVIEW_WIDTH 3
+#define QUEUE_SIZE 1024 /* power of two */
+#define LAYOUT_STACK_SIZE (8 * 1024 * 1024)
 #define MAX_MANAGED 1024
 #define MAX_MONITORS 16
 #define MAX_ZONES 16
+#define MAX_ZONESETS 8
+#define MAX_BINDINGS 32
+#define MAX_DOCKS 16
+#define SETTLE_MS 300
+#define DEFAULT_FIGHT_LIMIT 3
+#define STATE_VERSION 1
+#define STATE_FIELDS 11
+#define LAYOUT_VERSION 1
+#define LAYOUT_FIELDS 7
+#define SHARED_MAGIC 0x53584c46u /* "FLXS" */
 
 typedef enum {
     ZONE_ROWS = 0,
     ZONE_COLS = 1,
     ZONE_GRID = 2,
+    ZONE_MONOCLE = 3,
+    ZONE_STACK = 4,
 } ZoneLayout;
 
 typedef struct {
@@ -35,15 +69,54 @@ typedef struct {
     ZoneLayout layout;
     int max_windows; /* 0 == unlimited */
     int gap;
+    bool overflow_on;
+    ZoneLayout overflow;
+    int overflow_at; /* 0 == when cells drop below min_cell */
 } Zone;
 
+/* A zone list for one monitor.  Set 0 is the default; the others match a
+ * RandR output name or a monitor index. */
+typedef struct {
+    char match[32];
+    Zone zones[MAX_ZONES];
+    int zone_count;
+} ZoneSet;
+
+typedef enum {
+    ACTION_TILE = 0,
+    ACTION_FOCUS_NEXT = 1,
+    ACTION_SWAP_MASTER = 2,
+    ACTION_SEND_TO_ZONE = 3,
+    ACTION_CYCLE_ZONE = 4,
+} ActionType;
+
+typedef enum {
+    FIGHT_ACCEPT = 0, /* keep the client's size, clamped to its cell */
+    FIGHT_FLOAT = 1,  /* stop tiling the window */
+} FightPolicy;
+
+typedef struct {
+    unsigned int modifier;
+    KeySym key;
+    char key_name[64];
+    ActionType action;
+    char arg[32]; /* zone name for send-to-zone */
+} Binding;
+
 typedef struct {
     unsigned int modifier;
     KeySym trigger_key;
     char trigger_key_name[64];
     int gap;
-    Zone zones[MAX_ZONES];
-    int zone_count;
+    int min_cell;
+    int title_height;
+    unsigned int snap_modifier; /* 0 == drag snapping off */
+    int fight_limit;            /* 0 == never back off */
+    FightPolicy fight_policy;
+    ZoneSet zonesets[MAX_ZONESETS];
+    int zoneset_count;
+    Binding bindings[MAX_BINDINGS];
+    int binding_count;
 } Config;
 
 typedef struct {
@@ -60,6 +133,115 @@ typedef struct {
     int count;
 } ZoneBucket;
 
+/* Usable monitor area with its zone set resolved and the absolute zone rects
+ * precomputed.  Rebuilt only when geometry changes, so tiling and the
+ * navigation actions just index into it. */
+typedef struct {
+    Rect area;
+    char name[32]; /* RandR output name, empty when unknown */
+    const ZoneSet *set;
+    Rect zone_rects[MAX_ZONES];
+    Rect hit_rects[MAX_ZONES];             /* zone rects grown by the zone gap */
+    uint16_t hit_grid[HIT_GRID][HIT_GRID]; /* bit z: hit_rects[z] meets the cell */
+} Monitor;
+
+/* One tiled slot from the last layout pass.  Slots keep their rect; the
+ * navigation actions only move windows between slots. */
+typedef struct {
+    Window window;
+    Window frame;
+    int monitor;
+    int zone;
+    Rect rect;    /* slot rect last sent to the window */
+    Rect settled; /* frame geometry the WM produced for rect */
+    Rect actual;  /* latest frame geometry seen */
+    long long applied_ms; /* last apply, or last configure that settled it */
+    int fights;                  /* client resizes away from settled */
+    bool damped;                 /* fight_limit reached: size is left to the client */
+} Placement;
+
+typedef struct {
+    Placement items[MAX_MANAGED]; /* grouped by monitor, zone, then slot order */
+    int count;
+    ZoneLayout zone_layouts[MAX_MONITORS][MAX_ZONES]; /* after overflow */
+} Layout;
+
+typedef struct {
+    Monitor monitors[MAX_MONITORS];
+    int count;
+    Window docks[MAX_DOCKS]; /* the I/O thread watches their struts */
+    int dock_count;
+} MonitorTable;
+
+/* Published layout, mapped read-only by panels and scripts.  Readers copy
+ * it out and retry while seq is odd or changed underneath them. */
+typedef struct {
+    uint32_t window;
+    int32_t monitor;
+    int32_t zone;
+    int32_t x, y, width, height;
+    int32_t fights;
+} SharedPlacement;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    _Atomic uint32_t seq;
+    uint32_t count;
+    uint64_t generation;
+    uint32_t fights;        /* client resizes against the layout, since start */
+    uint32_t fights_damped; /* windows that reached fight_limit */
+    uint32_t floating;
+    int32_t monitor_count;
+    int32_t zone_counts[MAX_MONITORS];
+    char zone_names[MAX_MONITORS][MAX_ZONES][32];
+    SharedPlacement items[MAX_MANAGED];
+} SharedLayout;
+
+/* Messages between the X I/O thread and the layout thread. */
+typedef enum {
+    MSG_ACTION = 0,   /* a: binding index, -1 for the tile hotkey */
+    MSG_MAP = 1,      /* window: root child mapped */
+    MSG_UNMAP = 2,    /* window */
+    MSG_DESTROY = 3,  /* window */
+    MSG_CONFIGURE = 4, /* window, rect, time_ms */
+    MSG_GEOMETRY = 5, /* screen, RandR, workarea or desktop changed */
+    MSG_DRAG = 6,     /* a: 1 on press, 0 when released outside any zone */
+    MSG_DROP = 7,     /* frame dropped into zone b of monitor a */
+    MSG_MONITORS = 8, /* layout -> I/O: new hit-test table */
+} MsgType;
+
+typedef struct {
+    MsgType type;
+    Window window;
+    Rect rect;
+    int a;
+    int b;
+    long long time_ms;
+    MonitorTable *table;
+} Msg;
+
+/* Lock-free single-producer/single-consumer ring.  The pipe only wakes a
+ * sleeping consumer; the producer writes one byte per pushed batch. */
+typedef struct {
+    _Atomic unsigned int head; /* advanced by the consumer */
+    _Atomic unsigned int tail; /* advanced by the producer */
+    atomic_bool overflowed;
+    int wake[2];
+    Msg items[QUEUE_SIZE];
+} MsgQueue;
+
+/* Modifier+Button1 drag in progress. */
+typedef struct {
+    bool active;
+    Window frame;
+    Window client;
+    int start_x, start_y; /* pointer at press, root coordinates */
+    int frame_x, frame_y; /* frame origin at press */
+    int x, y;             /* frame origin after the last motion */
+    int monitor, zone;    /* hovered zone, -1 when none */
+} Drag;
+
 typedef struct {
     int left, right, top, bottom;
     int left_start_y, left_end_y;
@@ -68,9 +250,29 @@ typedef struct {
     int bottom_start_x, bottom_end_x;
 } Strut;
 
+/* --plan input: what a retile would read from the X server. */
+typedef struct {
+    int screen_w, screen_h;
+    Rect workarea;
+    Rect monitors[MAX_MONITORS];
+    char monitor_names[MAX_MONITORS][32];
+    int monitor_count;
+    Strut struts[MAX_DOCKS];
+    int strut_count;
+    Window windows[MAX_MANAGED];
+    Rect geometry[MAX_MANAGED]; /* current frame geometry */
+    char classes[MAX_MANAGED][32];
+    char zones[MAX_MANAGED][32]; /* zone the window is tiled in now, if any */
+    int window_count;
+} Scenario;
+
+/* Fields below io_dpy belong to the I/O thread; everything else to the
+ * layout thread once both are running.  Config is read-only by then. */
 typedef struct {
     Display *dpy;
     int screen;
+    int screen_w;
+    int screen_h;
     Window root;
     Atom atom_wm_state;
     Atom atom_net_workarea;
@@ -84,17 +286,67 @@ typedef struct {
     Atom atom_net_wm_state_max_vert;
     Atom atom_net_wm_strut;
     Atom atom_net_wm_strut_partial;
+    Atom atom_net_active_window;
+    Atom atom_fluxsnap_state;
+    Atom atom_fluxsnap_layout;
+    Atom atom_fluxsnap_zone_names;
+    Atom atom_utf8_string;
+    bool randr_monitors;
+    int randr_event_base;
     Config config;
+    Monitor monitors[MAX_MONITORS];
+    int monitor_count;
+    bool monitors_dirty;
+    Window docks[MAX_DOCKS]; /* docks seen by the last monitor refresh */
+    int dock_count;
+    Layout layout;
+    Layout parked; /* placements of managed windows that are not viewable */
+    bool state_dirty;
+    bool layout_dirty;
+    uint64_t generation;
+    SharedLayout *shared;
+    Window floating[MAX_MANAGED]; /* fight_policy=float casualties */
+    int floating_count;
+    unsigned long fights;
+    unsigned long fights_damped;
+    bool tile_pending;
+    bool dragging;            /* from MSG_DRAG/MSG_DROP, in queue order */
+    atomic_bool drag_active;  /* I/O thread's view, for resync after overflow */
+    MsgQueue to_layout;
+    MsgQueue to_io;
+
+    Display *io_dpy;
+    MonitorTable *io_table; /* hit-test snapshot from the layout thread */
+    Drag drag;
+    Window preview[4]; /* outline edges, created on first drag */
 } App;
 
 static int g_grab_badaccess = 0;
 
+/* Windows can disappear between the layout pass and an action; a stale id
+ * must not take the daemon down with Xlib's default exit-on-error handler. */
+static int xerr_ignore_handler(Display *dpy, XErrorEvent *ev) {
+    (void)dpy;
+    (void)ev;
+    return 0;
+}
+
 static int xerr_grab_handler(Display *dpy, XErrorEvent *ev) {
     (void)dpy;
     if (ev->error_code == BadAccess && ev->request_code == 33) g_grab_badaccess = 1;
     return 0;
 }
 
+static long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool rect_equal(const Rect *a, const Rect *b) {
+    return a->valid && b->valid && a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+}
+
 static char *trim(char *s) {
     while (isspace((unsigned char)*s)) s++;
     if (*s == '\0') return s;
@@ -123,35 +375,90 @@ static bool parse_modifier(const char *value, unsigned int *mod) {
     return false;
 }
 
+/* Parse "Super+Shift+j" style key combos. */
+static bool parse_keycombo(const char *spec, unsigned int *mods, KeySym *key) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    unsigned int m = 0;
+    char *p = buf;
+    char *plus;
+    while ((plus = strchr(p, '+')) != NULL && plus[1] != '\0') {
+        *plus = '\0';
+        unsigned int mod;
+        if (!parse_modifier(trim(p), &mod)) return false;
+        m |= mod;
+        p = plus + 1;
+    }
+
+    KeySym ks = XStringToKeysym(trim(p));
+    if (ks == NoSymbol) return false;
+
+    /* Key events are matched on the level-0 keysym: J must bind as j. */
+    KeySym lower, upper;
+    XConvertCase(ks, &lower, &upper);
+    *mods = m;
+    *key = lower;
+    return true;
+}
+
+static bool parse_action(const char *v, ActionType *action) {
+    if (strcasecmp(v, "tile") == 0) *action = ACTION_TILE;
+    else if (strcasecmp(v, "focus-next") == 0) *action = ACTION_FOCUS_NEXT;
+    else if (strcasecmp(v, "swap-master") == 0) *action = ACTION_SWAP_MASTER;
+    else if (strcasecmp(v, "send-to-zone") == 0) *action = ACTION_SEND_TO_ZONE;
+    else if (strcasecmp(v, "cycle-zone") == 0) *action = ACTION_CYCLE_ZONE;
+    else return false;
+    return true;
+}
+
 static ZoneLayout parse_zone_layout(const char *v) {
     if (strcasecmp(v, "cols") == 0) return ZONE_COLS;
     if (strcasecmp(v, "grid") == 0) return ZONE_GRID;
+    if (strcasecmp(v, "monocle") == 0) return ZONE_MONOCLE;
+    if (strcasecmp(v, "stack") == 0) return ZONE_STACK;
     return ZONE_ROWS;
 }
 
 static void set_default_config(Config *cfg) {
+    cfg->snap_modifier = 0;
+    cfg->fight_limit = DEFAULT_FIGHT_LIMIT;
+    cfg->fight_policy = FIGHT_ACCEPT;
     cfg->modifier = Mod4Mask;
     cfg->trigger_key = XK_space;
     snprintf(cfg->trigger_key_name, sizeof(cfg->trigger_key_name), "space");
     cfg->gap = DEFAULT_GAP;
-    cfg->zone_count = 3;
-
-    cfg->zones[0] = (Zone){"left", 0, 0, 34, 100, ZONE_ROWS, 0, DEFAULT_GAP};
-    cfg->zones[1] = (Zone){"middle", 34, 0, 33, 100, ZONE_ROWS, 0, DEFAULT_GAP};
-    cfg->zones[2] = (Zone){"right", 67, 0, 33, 100, ZONE_ROWS, 0, DEFAULT_GAP};
+    cfg->min_cell = DEFAULT_MIN_CELL;
+    cfg->title_height = DEFAULT_TITLE_HEIGHT;
+    cfg->zoneset_count = 1;
+    cfg->binding_count = 0;
+
+    ZoneSet *def = &cfg->zonesets[0];
+    def->match[0] = '\0';
+    def->zone_count = 3;
+    def->zones[0] = (Zone){"left", 0, 0, 34, 100, ZONE_ROWS, 0, DEFAULT_GAP, false, ZONE_ROWS, 0};
+    def->zones[1] = (Zone){"middle", 34, 0, 33, 100, ZONE_ROWS, 0, DEFAULT_GAP, false, ZONE_ROWS, 0};
+    def->zones[2] = (Zone){"right", 67, 0, 33, 100, ZONE_ROWS, 0, DEFAULT_GAP, false, ZONE_ROWS, 0};
 }
 
-static void parse_zone(Config *cfg, const char *value) {
-    if (cfg->zone_count >= MAX_ZONES) return;
+static void parse_zone(const Config *cfg, ZoneSet *set, const char *value) {
+    if (set->zone_count >= MAX_ZONES) return;
 
     char buf[256];
     snprintf(buf, sizeof(buf), "%s", value);
 
     char *parts[8] = {0};
+    char *opts[4] = {0};
     int n = 0;
+    int nopt = 0;
     char *tok = strtok(buf, ",");
-    while (tok && n < 8) {
-        parts[n++] = trim(tok);
+    while (tok) {
+        tok = trim(tok);
+        if (strchr(tok, '=')) {
+            if (nopt < 4) opts[nopt++] = tok;
+        } else if (n < 8) {
+            parts[n++] = tok;
+        }
         tok = strtok(NULL, ",");
     }
     if (n < 6) return;
@@ -172,7 +479,77 @@ static void parse_zone(Config *cfg, const char *value) {
     if (z.h_pct < 1) z.h_pct = 1;
     if (z.gap < 0) z.gap = 0;
 
-    cfg->zones[cfg->zone_count++] = z;
+    for (int i = 0; i < nopt; i++) {
+        char *eq = strchr(opts[i], '=');
+        *eq = '\0';
+        char *k = trim(opts[i]);
+        char *v = trim(eq + 1);
+        if (strcasecmp(k, "overflow") == 0) {
+            z.overflow_on = strcasecmp(v, "none") != 0;
+            z.overflow = parse_zone_layout(v);
+        } else if (strcasecmp(k, "overflow_at") == 0) {
+            z.overflow_at = atoi(v);
+            if (z.overflow_at < 0) z.overflow_at = 0;
+        }
+    }
+
+    set->zones[set->zone_count++] = z;
+}
+
+/* zoneset=NAME|INDEX starts a set; zoneset=default goes back to set 0. */
+static ZoneSet *parse_zoneset(Config *cfg, const char *value) {
+    if (*value == '\0' || strcasecmp(value, "default") == 0) return &cfg->zonesets[0];
+
+    for (int i = 1; i < cfg->zoneset_count; i++) {
+        if (strcmp(cfg->zonesets[i].match, value) == 0) return &cfg->zonesets[i];
+    }
+    if (cfg->zoneset_count >= MAX_ZONESETS) {
+        fprintf(stderr, "fluxsnap: too many zone sets, ignoring '%s'\n", value);
+        return NULL;
+    }
+
+    ZoneSet *set = &cfg->zonesets[cfg->zoneset_count++];
+    snprintf(set->match, sizeof(set->match), "%s", value);
+    set->zone_count = 0;
+    return set;
+}
+
+/* bind=MODS+KEY,action [zone] */
+static void parse_binding(Config *cfg, const char *value) {
+    if (cfg->binding_count >= MAX_BINDINGS) return;
+
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", value);
+
+    char *comma = strchr(buf, ',');
+    if (!comma) return;
+    *comma = '\0';
+
+    Binding b = {0};
+    char *combo = trim(buf);
+    if (!parse_keycombo(combo, &b.modifier, &b.key)) {
+        fprintf(stderr, "fluxsnap: ignoring bind with unknown key combo '%s'\n", combo);
+        return;
+    }
+    snprintf(b.key_name, sizeof(b.key_name), "%s", combo);
+
+    char *action = trim(comma + 1);
+    char *arg = action;
+    while (*arg && !isspace((unsigned char)*arg)) arg++;
+    if (*arg) *arg++ = '\0';
+    arg = trim(arg);
+
+    if (!parse_action(action, &b.action)) {
+        fprintf(stderr, "fluxsnap: ignoring bind with unknown action '%s'\n", action);
+        return;
+    }
+    if (b.action == ACTION_SEND_TO_ZONE && *arg == '\0') {
+        fprintf(stderr, "fluxsnap: send-to-zone needs a zone name\n");
+        return;
+    }
+    snprintf(b.arg, sizeof(b.arg), "%s", arg);
+
+    cfg->bindings[cfg->binding_count++] = b;
 }
 
 static void load_config_file(Config *cfg, const char *path) {
@@ -182,6 +559,7 @@ static void load_config_file(Config *cfg, const char *path) {
     char line[512];
     unsigned int parsed_mod;
     bool zone_reset = false;
+    ZoneSet *set = &cfg->zonesets[0];
 
     while (fgets(line, sizeof(line), f)) {
         char *p = trim(line);
@@ -196,6 +574,9 @@ static void load_config_file(Config *cfg, const char *path) {
 
         if (strcasecmp(key, "modifier") == 0 && parse_modifier(value, &parsed_mod)) {
             cfg->modifier = parsed_mod;
+        } else if (strcasecmp(key, "snap_modifier") == 0) {
+            if (strcasecmp(value, "none") == 0) cfg->snap_modifier = 0;
+            else if (parse_modifier(value, &parsed_mod)) cfg->snap_modifier = parsed_mod;
         } else if (strcasecmp(key, "hotkey") == 0) {
             KeySym ks = XStringToKeysym(value);
             if (ks != NoSymbol) {
@@ -205,12 +586,28 @@ static void load_config_file(Config *cfg, const char *path) {
         } else if (strcasecmp(key, "gap") == 0) {
             long v = strtol(value, NULL, 10);
             if (v >= 0 && v <= 300) cfg->gap = (int)v;
+        } else if (strcasecmp(key, "min_cell") == 0) {
+            long v = strtol(value, NULL, 10);
+            if (v >= 1 && v <= 4096) cfg->min_cell = (int)v;
+        } else if (strcasecmp(key, "title_height") == 0) {
+            long v = strtol(value, NULL, 10);
+            if (v >= 0 && v <= 200) cfg->title_height = (int)v;
+        } else if (strcasecmp(key, "fight_limit") == 0) {
+            long v = strtol(value, NULL, 10);
+            if (v >= 0 && v <= 100) cfg->fight_limit = (int)v;
+        } else if (strcasecmp(key, "fight_policy") == 0) {
+            cfg->fight_policy = strcasecmp(value, "float") == 0 ? FIGHT_FLOAT : FIGHT_ACCEPT;
+        } else if (strcasecmp(key, "zoneset") == 0) {
+            set = parse_zoneset(cfg, value);
         } else if (strcasecmp(key, "zone") == 0) {
-            if (!zone_reset) {
-                cfg->zone_count = 0;
+            if (!set) continue;
+            if (set == &cfg->zonesets[0] && !zone_reset) {
+                set->zone_count = 0;
                 zone_reset = true;
             }
-            parse_zone(cfg, value);
+            parse_zone(cfg, set, value);
+        } else if (strcasecmp(key, "bind") == 0) {
+            parse_binding(cfg, value);
         }
     }
     fclose(f);
@@ -242,7 +639,7 @@ static void load_config(Config *cfg, const char *explicit_path) {
     load_config_file(cfg, "/usr/local/etc/fluxsnap.conf");
 }
 
-static bool root_cardinal(App *app, Atom property, unsigned long **out, unsigned long *count) {
+static bool root_cardinal(App *app, Atom property, long max_items, unsigned long **out, unsigned long *count) {
     Atom actual_type;
     int actual_format;
     unsigned long nitems, bytes_after;
@@ -252,7 +649,7 @@ static bool root_cardinal(App *app, Atom property, unsigned long **out, unsigned
                            app->root,
                            property,
                            0,
-                           4096,
+                           max_items,
                            False,
                            XA_CARDINAL,
                            &actual_type,
@@ -306,8 +703,8 @@ static bool get_window_strut(App *app, Window w, Strut *out) {
                            &data) == Success
         && data && actual_format == 32 && nitems >= 4) {
         unsigned long *v = (unsigned long *)data;
-        int sw = DisplayWidth(app->dpy, app->screen);
-        int sh = DisplayHeight(app->dpy, app->screen);
+        int sw = app->screen_w;
+        int sh = app->screen_h;
         *out = (Strut){
             (int)v[0], (int)v[1], (int)v[2], (int)v[3],
             0, sh - 1, 0, sh - 1,
@@ -362,14 +759,15 @@ static void apply_strut_to_monitor(Rect *mon, const Strut *s, int sw, int sh) {
 /* Walk all root-window children, find docks, and clip every monitor rect to
  * exclude their reserved strut areas.  This handles cases where the WM has not
  * updated _NET_WORKAREA to reflect the toolbar position. */
-static void apply_dock_struts(App *app, Rect mons[], int nmon) {
-    int sw = DisplayWidth(app->dpy, app->screen);
-    int sh = DisplayHeight(app->dpy, app->screen);
+static void apply_dock_struts(App *app, Monitor mons[], int nmon) {
+    int sw = app->screen_w;
+    int sh = app->screen_h;
 
     Window root_ret, parent_ret;
     Window *children = NULL;
     unsigned int nchildren = 0;
 
+    app->dock_count = 0;
     if (!XQueryTree(app->dpy, app->root, &root_ret, &parent_ret, &children, &nchildren))
         return;
 
@@ -379,28 +777,30 @@ static void apply_dock_struts(App *app, Rect mons[], int nmon) {
                              app->atom_net_wm_window_type_dock))
             continue;
 
+        /* Docks without a strut are kept too: they may set one later. */
+        if (app->dock_count < MAX_DOCKS) app->docks[app->dock_count++] = children[i];
+
         Strut strut;
         if (!get_window_strut(app, children[i], &strut))
             continue;
-
         for (int m = 0; m < nmon; m++)
-            apply_strut_to_monitor(&mons[m], &strut, sw, sh);
+            apply_strut_to_monitor(&mons[m].area, &strut, sw, sh);
     }
 
     if (children) XFree(children);
 }
 
 static Rect get_workarea(App *app) {
-    Rect wa = {0, 0, DisplayWidth(app->dpy, app->screen), DisplayHeight(app->dpy, app->screen), true};
+    Rect wa = {0, 0, app->screen_w, app->screen_h, true};
 
     unsigned long *workareas = NULL;
     unsigned long wa_count = 0;
-    if (!root_cardinal(app, app->atom_net_workarea, &workareas, &wa_count)) return wa;
+    if (!root_cardinal(app, app->atom_net_workarea, 4096, &workareas, &wa_count)) return wa;
 
     unsigned long desktop = 0;
     unsigned long *desktop_prop = NULL;
     unsigned long desktop_count = 0;
-    if (root_cardinal(app, app->atom_net_current_desktop, &desktop_prop, &desktop_count)) {
+    if (root_cardinal(app, app->atom_net_current_desktop, 1, &desktop_prop, &desktop_count)) {
         desktop = desktop_prop[0];
         XFree(desktop_prop);
     }
@@ -420,12 +820,11 @@ static Rect get_workarea(App *app) {
     XFree(workareas);
 
     if (wa.width <= 0 || wa.height <= 0) {
-        wa = (Rect){0, 0, DisplayWidth(app->dpy, app->screen), DisplayHeight(app->dpy, app->screen), true};
+        wa = (Rect){0, 0, app->screen_w, app->screen_h, true};
     }
     return wa;
 }
 
-#ifdef HAVE_XINERAMA
 static Rect rect_intersection(const Rect *a, const Rect *b) {
     int x1 = (a->x > b->x) ? a->x : b->x;
     int y1 = (a->y > b->y) ? a->y : b->y;
@@ -434,30 +833,56 @@ static Rect rect_intersection(const Rect *a, const Rect *b) {
     if (x2 <= x1 || y2 <= y1) return (Rect){0};
     return (Rect){x1, y1, x2 - x1, y2 - y1, true};
 }
-#endif
 
-static int get_visible_monitors(App *app, Rect workarea, Rect out[MAX_MONITORS]) {
+/* Fill `out` with the visible monitors clipped to the workarea.  RandR 1.5
+ * monitors are preferred because they carry output names for zone sets. */
+static int get_visible_monitors(App *app, Rect workarea, Monitor out[MAX_MONITORS]) {
     int n = 0;
 
-#ifndef HAVE_XINERAMA
+#if !defined(HAVE_XINERAMA) && !defined(HAVE_XRANDR)
     (void)app;
-#else
+#endif
+
+#ifdef HAVE_XRANDR
+    if (app->randr_monitors) {
+        int rcount = 0;
+        XRRMonitorInfo *rm = XRRGetMonitors(app->dpy, app->root, True, &rcount);
+        if (rm) {
+            for (int i = 0; i < rcount && n < MAX_MONITORS; i++) {
+                Rect mon = {rm[i].x, rm[i].y, rm[i].width, rm[i].height, true};
+                Rect clipped = rect_intersection(&workarea, &mon);
+                if (!clipped.valid) continue;
+
+                out[n] = (Monitor){.area = clipped};
+                char *name = XGetAtomName(app->dpy, rm[i].name);
+                if (name) {
+                    snprintf(out[n].name, sizeof(out[n].name), "%s", name);
+                    XFree(name);
+                }
+                n++;
+            }
+            XRRFreeMonitors(rm);
+        }
+    }
+#endif
+
+#ifdef HAVE_XINERAMA
     int evb, erb;
-    if (XineramaQueryExtension(app->dpy, &evb, &erb) && XineramaIsActive(app->dpy)) {
+    if (n == 0 && XineramaQueryExtension(app->dpy, &evb, &erb) && XineramaIsActive(app->dpy)) {
         int xcount = 0;
         XineramaScreenInfo *xs = XineramaQueryScreens(app->dpy, &xcount);
         if (xs && xcount > 0) {
             for (int i = 0; i < xcount && n < MAX_MONITORS; i++) {
                 Rect mon = {xs[i].x_org, xs[i].y_org, xs[i].width, xs[i].height, true};
                 Rect clipped = rect_intersection(&workarea, &mon);
-                if (clipped.valid) out[n++] = clipped;
+                if (clipped.valid) out[n++] = (Monitor){.area = clipped};
             }
             XFree(xs);
         }
     }
 #endif
 
-    if (n == 0) out[n++] = workarea;
+    if (n == 0) out[n++] = (Monitor){.area = workarea};
     return n;
 }
 
@@ -496,10 +921,14 @@ static bool window_has_atom(App *app, Window w, Atom prop, Atom expected) {
     return found;
 }
 
-static bool is_normal_window(App *app, Window w) {
+/* A managed, non-dock client.  With `viewable` NULL only windows on screen
+ * count; otherwise unmapped ones do too and *viewable tells them apart. */
+static bool is_normal_window(App *app, Window w, bool *viewable) {
     XWindowAttributes attrs;
     if (!XGetWindowAttributes(app->dpy, w, &attrs)) return false;
-    if (attrs.override_redirect || attrs.map_state != IsViewable) return false;
+    if (attrs.override_redirect) return false;
+    if (viewable) *viewable = attrs.map_state == IsViewable;
+    else if (attrs.map_state != IsViewable) return false;
 
     if (window_has_atom(app, w, app->atom_net_wm_window_type, app->atom_net_wm_window_type_dock)) return false;
 
@@ -548,7 +977,7 @@ static void clear_maximized_state(App *app, Window w) {
     XSendEvent(app->dpy, app->root, False, SubstructureRedirectMask | SubstructureNotifyMask, &ev);
 }
 
-static void apply_rect(App *app, Window w, Rect r) {
+static void apply_rect(App *app, Window w, Window frame, Rect r) {
     if (r.width < 1) r.width = 1;
     if (r.height < 1) r.height = 1;
 
@@ -566,11 +995,12 @@ static void apply_rect(App *app, Window w, Rect r) {
     ev.xclient.data.l[4] = r.height;
     XSendEvent(app->dpy, app->root, False, SubstructureRedirectMask | SubstructureNotifyMask, &ev);
 
-    Window frame = frame_window_for_client(app, w);
     XMoveResizeWindow(app->dpy, frame, r.x, r.y, (unsigned int)r.width, (unsigned int)r.height);
 }
 
-static int load_client_list(App *app, Window out[MAX_MANAGED]) {
+/* Viewable clients go to `out`; managed clients that are not viewable (other
+ * workspaces, iconified) to `hidden` when it is given. */
+static int load_client_list(App *app, Window out[MAX_MANAGED], Window hidden[MAX_MANAGED], int *hidden_count) {
     Atom actual_type;
     int actual_format;
     unsigned long nitems, bytes_after;
@@ -592,10 +1022,14 @@ static int load_client_list(App *app, Window out[MAX_MANAGED]) {
     }
 
     int count = 0;
+    if (hidden_count) *hidden_count = 0;
     if (data && actual_type == XA_WINDOW && actual_format == 32) {
         Window *wins = (Window *)data;
         for (unsigned long i = 0; i < nitems && count < MAX_MANAGED; i++) {
-            if (is_normal_window(app, wins[i])) out[count++] = wins[i];
+            bool viewable = true;
+            if (!is_normal_window(app, wins[i], hidden ? &viewable : NULL)) continue;
+            if (viewable) out[count++] = wins[i];
+            else hidden[(*hidden_count)++] = wins[i];
         }
     }
     if (data) XFree(data);
@@ -628,11 +1062,58 @@ static Rect zone_rect_for_monitor(const Rect *monitor, const Zone *z, int global
     return r;
 }
 
-static void layout_zone(App *app, ZoneBucket *b, ZoneLayout layout, int gap) {
-    int n = b->count;
+/* Switch to the zone's overflow layout once it holds more than overflow_at
+ * windows or, with overflow_at=0, once the base layout would cut cells
+ * smaller than min_cell. */
+static ZoneLayout zone_layout_for(const Config *cfg, const Zone *z, const Rect *a, int n) {
+    if (!z->overflow_on || n <= 1) return z->layout;
+    if (z->overflow_at > 0) return (n > z->overflow_at) ? z->overflow : z->layout;
+
+    int cell;
+    if (z->layout == ZONE_ROWS) {
+        cell = (a->height - (n - 1) * z->gap) / n;
+    } else if (z->layout == ZONE_COLS) {
+        cell = (a->width - (n - 1) * z->gap) / n;
+    } else if (z->layout == ZONE_GRID) {
+        int cols = 1;
+        while (cols * cols < n) cols++;
+        int rows = (n + cols - 1) / cols;
+        int cw = (a->width - (cols - 1) * z->gap) / cols;
+        int ch = (a->height - (rows - 1) * z->gap) / rows;
+        cell = (cw < ch) ? cw : ch;
+    } else {
+        return z->layout;
+    }
+    return (cell < cfg->min_cell) ? z->overflow : z->layout;
+}
+
+/* Split a zone area into n window rects.  Pure geometry, no X traffic, so
+ * the navigation actions can re-run it against the cached layout. */
+static void layout_zone(const Rect *area, int n, ZoneLayout layout, int gap, int title_h, Rect out[]) {
     if (n <= 0) return;
 
-    Rect a = b->area;
+    Rect a = *area;
+    if (layout == ZONE_MONOCLE) {
+        for (int i = 0; i < n; i++) out[i] = a;
+        return;
+    }
+
+    /* Master in front at the bottom of the cascade; the next STACK_MAX_DEPTH
+     * windows peek out one title bar above each other, the rest share the
+     * top offset behind them. */
+    if (layout == ZONE_STACK) {
+        int depth = (n - 1 < STACK_MAX_DEPTH) ? n - 1 : STACK_MAX_DEPTH;
+        int step = title_h;
+        if (depth > 0 && depth * step > a.height / 2) step = a.height / 2 / depth;
+        int h = a.height - depth * step;
+        out[0] = (Rect){a.x, a.y + depth * step, a.width, h, true};
+        for (int i = 1; i < n; i++) {
+            int off = depth - ((i < depth) ? i : depth);
+            out[i] = (Rect){a.x, a.y + off * step, a.width, h, true};
+        }
+        return;
+    }
+
     if (layout == ZONE_COLS) {
         int usable = a.width - ((n - 1) * gap);
         if (usable < n) usable = n;
@@ -641,7 +1122,7 @@ static void layout_zone(App *app, ZoneBucket *b, ZoneLayout layout, int gap) {
         int rem = usable % n;
         for (int i = 0; i < n; i++) {
             int w = base + (i < rem ? 1 : 0);
-            apply_rect(app, b->windows[i], (Rect){x, a.y, w, a.height, true});
+            out[i] = (Rect){x, a.y, w, a.height, true};
             x += w + gap;
         }
         return;
@@ -666,7 +1147,7 @@ static void layout_zone(App *app, ZoneBucket *b, ZoneLayout layout, int gap) {
                 int y = a.y + r * (ch + gap);
                 int w = (c == cols - 1) ? (a.x + a.width - x) : cw;
                 int h = (r == rows - 1) ? (a.y + a.height - y) : ch;
-                apply_rect(app, b->windows[idx++], (Rect){x, y, w, h, true});
+                out[idx++] = (Rect){x, y, w, h, true};
             }
         }
         return;
@@ -679,12 +1160,113 @@ static void layout_zone(App *app, ZoneBucket *b, ZoneLayout layout, int gap) {
     int rem = usable % n;
     for (int i = 0; i < n; i++) {
         int h = base + (i < rem ? 1 : 0);
-        apply_rect(app, b->windows[i], (Rect){a.x, y, a.width, h, true});
+        out[i] = (Rect){a.x, y, a.width, h, true};
         y += h + gap;
     }
 }
 
-static int monitor_index_for_window_center(App *app, const Rect mons[], int nmon, Window w) {
+static const ZoneSet *zoneset_for_monitor(const Config *cfg, int index, const char *name) {
+    char idx[16];
+    snprintf(idx, sizeof(idx), "%d", index);
+
+    for (int i = 1; i < cfg->zoneset_count; i++) {
+        const ZoneSet *set = &cfg->zonesets[i];
+        if (set->zone_count == 0) continue;
+        if ((name[0] && strcmp(set->match, name) == 0) || strcmp(set->match, idx) == 0) return set;
+    }
+    return &cfg->zonesets[0];
+}
+
+static bool rect_contains(const Rect *r, int x, int y) {
+    return x >= r->x && x < r->x + r->width && y >= r->y && y < r->y + r->height;
+}
+
+/* Bucket the hit rects into a HIT_GRID x HIT_GRID grid over the monitor so a
+ * pointer lookup only tests the zones touching its cell. */
+static void build_hit_grid(Monitor *mon) {
+    const Rect *a = &mon->area;
+    memset(mon->hit_grid, 0, sizeof(mon->hit_grid));
+    if (a->width <= 0 || a->height <= 0) return;
+
+    for (int z = 0; z < mon->set->zone_count; z++) {
+        const Rect *r = &mon->hit_rects[z];
+        int cx0 = (r->x - a->x) * HIT_GRID / a->width;
+        int cy0 = (r->y - a->y) * HIT_GRID / a->height;
+        int cx1 = (r->x + r->width - 1 - a->x) * HIT_GRID / a->width;
+        int cy1 = (r->y + r->height - 1 - a->y) * HIT_GRID / a->height;
+        if (cx0 < 0) cx0 = 0;
+        if (cy0 < 0) cy0 = 0;
+        if (cx1 >= HIT_GRID) cx1 = HIT_GRID - 1;
+        if (cy1 >= HIT_GRID) cy1 = HIT_GRID - 1;
+        for (int cy = cy0; cy <= cy1; cy++) {
+            for (int cx = cx0; cx <= cx1; cx++) mon->hit_grid[cy][cx] |= (uint16_t)(1u << z);
+        }
+    }
+}
+
+static int zone_at(const Monitor *mon, int x, int y) {
+    const Rect *a = &mon->area;
+    if (!rect_contains(a, x, y)) return -1;
+
+    unsigned int mask = mon->hit_grid[(y - a->y) * HIT_GRID / a->height][(x - a->x) * HIT_GRID / a->width];
+    for (int z = 0; mask; z++, mask >>= 1) {
+        if ((mask & 1) && rect_contains(&mon->hit_rects[z], x, y)) return z;
+    }
+    return -1;
+}
+
+/* Resolve each monitor's zone set and turn the zone percentages into
+ * absolute rects once, instead of on every tile. */
+static void resolve_monitor_zones(const Config *cfg, Monitor mons[], int nmon) {
+    for (int m = 0; m < nmon; m++) {
+        const ZoneSet *set = zoneset_for_monitor(cfg, m, mons[m].name);
+        mons[m].set = set;
+        for (int z = 0; z < set->zone_count; z++) {
+            Rect r = zone_rect_for_monitor(&mons[m].area, &set->zones[z], cfg->gap);
+            int g = set->zones[z].gap;
+            mons[m].zone_rects[z] = r;
+            mons[m].hit_rects[z] = (Rect){r.x - g, r.y - g, r.width + 2 * g, r.height + 2 * g, true};
+        }
+        build_hit_grid(&mons[m]);
+    }
+}
+
+static void publish_monitors(App *app);
+
+/* The layout connection sees no events, so the screen size is read back
+ * instead of trusting Xlib's cached DisplayWidth/DisplayHeight. */
+static void refresh_monitors(App *app) {
+    Window root_ret;
+    int x, y;
+    unsigned int width, height, border, depth;
+    if (XGetGeometry(app->dpy, app->root, &root_ret, &x, &y, &width, &height, &border, &depth)) {
+        app->screen_w = (int)width;
+        app->screen_h = (int)height;
+    }
+
+    Rect wa = get_workarea(app);
+    app->monitor_count = get_visible_monitors(app, wa, app->monitors);
+    apply_dock_struts(app, app->monitors, app->monitor_count);
+    resolve_monitor_zones(&app->config, app->monitors, app->monitor_count);
+    app->monitors_dirty = false;
+    publish_monitors(app);
+}
+
+static bool is_known_dock(const App *app, Window w) {
+    for (int i = 0; i < app->dock_count; i++) {
+        if (app->docks[i] == w) return true;
+    }
+    return false;
+}
+
+static int monitor_at(const Monitor mons[], int nmon, int x, int y) {
+    for (int i = 0; i < nmon; i++) {
+        if (rect_contains(&mons[i].area, x, y)) return i;
+    }
+    return 0;
+}
+
+static int monitor_index_for_window_center(App *app, Window w) {
     XWindowAttributes attrs;
     if (!XGetWindowAttributes(app->dpy, w, &attrs)) return 0;
 
@@ -699,127 +1281,1551 @@ static int monitor_index_for_window_center(App *app, const Rect mons[], int nmon
                           &rx,
                           &ry,
                           &child);
+    return monitor_at(app->monitors, app->monitor_count, rx, ry);
+}
 
-    for (int i = 0; i < nmon; i++) {
-        if (rx >= mons[i].x && rx < mons[i].x + mons[i].width && ry >= mons[i].y && ry < mons[i].y + mons[i].height) {
-            return i;
-        }
+static Placement *layout_find(Layout *lay, Window w) {
+    for (int i = 0; i < lay->count; i++) {
+        if (lay->items[i].window == w || lay->items[i].frame == w) return &lay->items[i];
     }
-    return 0;
+    return NULL;
 }
 
-static void tile_all_windows(App *app) {
-    Window wins[MAX_MANAGED];
-    int count = load_client_list(app, wins);
-    if (count <= 0) return;
+/* A placement is in place while its frame still has the geometry the WM
+ * settled on after our last apply. */
+static bool placement_in_place(const Placement *p) {
+    return rect_equal(&p->settled, &p->actual);
+}
 
-    Rect wa = get_workarea(app);
-    Rect mons[MAX_MONITORS] = {0};
-    int nmon = get_visible_monitors(app, wa, mons);
-    apply_dock_struts(app, mons, nmon);
+static void apply_placement(App *app, Placement *p) {
+    apply_rect(app, p->window, p->frame, p->rect);
+    p->applied_ms = now_ms();
+    p->settled.valid = false;
+    app->state_dirty = true;
+    app->layout_dirty = true;
+}
+
+/* Carry tracking state over from the previous layout and only send the
+ * configure when the slot changed or the window was moved since. */
+/* The first time a window is damped its size is clamped to the cell once;
+ * after that whatever size it picks is taken as settled.  A floated window
+ * is left in the layout until the retile this schedules drops it. */
+static void damp_fight(App *app, Placement *p) {
+    bool first = !p->damped;
+    if (first) {
+        p->damped = true;
+        app->fights_damped++;
+    }
+    if (app->config.fight_policy == FIGHT_FLOAT) {
+        if (app->floating_count < MAX_MANAGED) app->floating[app->floating_count++] = p->window;
+        app->tile_pending = true;
+        return;
+    }
+
+    Rect r = p->actual;
+    if (r.width > p->settled.width) r.width = p->settled.width;
+    if (r.height > p->settled.height) r.height = p->settled.height;
+    if (!first || rect_equal(&r, &p->actual)) {
+        p->settled = p->actual;
+        app->state_dirty = true;
+        return;
+    }
+    apply_rect(app, p->window, p->frame, r);
+    p->applied_ms = now_ms();
+    p->settled.valid = false;
+}
+
+/* p is about to get the same slot again because it was resized away from the
+ * geometry it settled on: the client is fighting the layout.  That counts
+ * once per apply; past fight_limit, back off instead of re-applying.
+ * Returns true when the caller must not re-apply. */
+static bool note_fight(App *app, Placement *p) {
+    const Rect *s = &p->settled;
+    const Rect *a = &p->actual;
+    if (!s->valid || !a->valid) return false;
+    if (a->x != s->x || a->y != s->y) return false; /* moved, not a resize */
+
+    p->fights++;
+    app->fights++;
+    app->layout_dirty = true;
+    if (app->config.fight_limit == 0 || (!p->damped && p->fights < app->config.fight_limit)) return false;
+    damp_fight(app, p);
+    return true;
+}
+
+static void place_window(App *app, const Placement *old, Placement *p) {
+    if (!old) {
+        p->frame = frame_window_for_client(app, p->window);
+        p->settled = p->actual = (Rect){0};
+        apply_placement(app, p);
+        return;
+    }
+
+    p->frame = old->frame;
+    p->settled = old->settled;
+    p->actual = old->actual;
+    p->applied_ms = old->applied_ms;
+    p->fights = old->fights;
+    p->damped = old->damped;
+    if (rect_equal(&old->rect, &p->rect)) {
+        if (placement_in_place(old) || note_fight(app, p)) return;
+    }
+    apply_placement(app, p);
+}
+
+static int zone_span(const Layout *lay, int m, int z, int *n) {
+    int first = -1;
+    *n = 0;
+    for (int i = 0; i < lay->count; i++) {
+        if (lay->items[i].monitor != m || lay->items[i].zone != z) continue;
+        if (first < 0) first = i;
+        (*n)++;
+    }
+    return first;
+}
+
+/* Monocle shows only the master and stack the master plus its cascade, so
+ * only those get restacked however many windows the zone holds. */
+static void raise_zone(App *app, const Placement *first, int n, ZoneLayout layout) {
+    if (n <= 0) return;
+    if (layout == ZONE_STACK) {
+        int depth = (n - 1 < STACK_MAX_DEPTH) ? n - 1 : STACK_MAX_DEPTH;
+        for (int i = depth; i >= 1; i--) XRaiseWindow(app->dpy, first[i].frame);
+    } else if (layout != ZONE_MONOCLE) {
+        return;
+    }
+    XRaiseWindow(app->dpy, first[0].frame);
+}
+
+static void restack_zone_of(App *app, const Placement *p) {
+    const Layout *lay = &app->layout;
+    int n;
+    int first = zone_span(lay, p->monitor, p->zone, &n);
+    if (first >= 0) raise_zone(app, &lay->items[first], n, lay->zone_layouts[p->monitor][p->zone]);
+}
+
+static bool is_floating(const App *app, Window w) {
+    for (int i = 0; i < app->floating_count; i++) {
+        if (app->floating[i] == w) return true;
+    }
+    return false;
+}
+
+static void unfloat_window(App *app, Window w) {
+    for (int i = 0; i < app->floating_count; i++) {
+        if (app->floating[i] != w) continue;
+        app->floating[i] = app->floating[--app->floating_count];
+        return;
+    }
+}
+
+/* Drop floating windows from the client list, and forget floating windows
+ * that are no longer managed. */
+static bool window_in(const Window *list, int count, Window w) {
+    for (int i = 0; i < count; i++) {
+        if (list[i] == w) return true;
+    }
+    return false;
+}
+
+static int skip_floating(App *app, Window wins[MAX_MANAGED], int count, const Window *hidden, int nhidden) {
+    for (int i = 0; i < app->floating_count;) {
+        Window w = app->floating[i];
+        if (!window_in(wins, count, w) && !window_in(hidden, nhidden, w)) {
+            app->floating[i] = app->floating[--app->floating_count];
+        } else {
+            i++;
+        }
+    }
+    if (app->floating_count == 0) return count;
+
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        if (!is_floating(app, wins[i])) wins[n++] = wins[i];
+    }
+    return n;
+}
+
+/* Assign windows to zones and compute their slots.  Windows keep the zone and
+ * slot order they had in prev; new ones go to the emptiest zone that still
+ * takes windows.  out_old[i] is the previous placement of out->items[i], if
+ * any.  No X calls, so --plan runs exactly what a retile does. */
+static void plan_layout(const Config *cfg, const Monitor mons[], int nmon, const Window wins[],
+                        const int win_mon[], const Placement *const win_old[], int count,
+                        const Layout *prev, Layout *lay, const Placement *out_old[MAX_MANAGED]) {
+    lay->count = 0;
 
     for (int m = 0; m < nmon; m++) {
+        const Monitor *mon = &mons[m];
+        const ZoneSet *set = mon->set;
+        if (set->zone_count == 0) continue;
+
         ZoneBucket buckets[MAX_ZONES] = {0};
-        for (int z = 0; z < app->config.zone_count; z++) {
-            buckets[z].area = zone_rect_for_monitor(&mons[m], &app->config.zones[z], app->config.gap);
+        const Placement *olds[MAX_ZONES][MAX_MANAGED];
+        bool taken[MAX_MANAGED] = {0};
+        for (int z = 0; z < set->zone_count; z++) buckets[z].area = mon->zone_rects[z];
+
+        /* Windows stay in the zone and slot order they had last time. */
+        for (int k = 0; k < prev->count; k++) {
+            const Placement *old = &prev->items[k];
+            if (old->monitor != m || old->zone >= set->zone_count) continue;
+
+            int i = 0;
+            while (i < count && wins[i] != old->window) i++;
+            if (i == count || win_mon[i] != m) continue;
+
+            ZoneBucket *b = &buckets[old->zone];
+            int maxw = set->zones[old->zone].max_windows;
+            if (maxw != 0 && b->count >= maxw) continue;
+
+            olds[old->zone][b->count] = old;
+            b->windows[b->count++] = old->window;
+            taken[i] = true;
         }
 
         for (int i = 0; i < count; i++) {
-            int mon = monitor_index_for_window_center(app, mons, nmon, wins[i]);
-            if (mon != m) continue;
+            if (taken[i] || win_mon[i] != m) continue;
 
             int chosen = -1;
-            for (int z = 0; z < app->config.zone_count; z++) {
-                int maxw = app->config.zones[z].max_windows;
+            for (int z = 0; z < set->zone_count; z++) {
+                int maxw = set->zones[z].max_windows;
                 if (maxw == 0 || buckets[z].count < maxw) {
                     if (chosen < 0 || buckets[z].count < buckets[chosen].count) chosen = z;
                 }
             }
-            if (chosen < 0) chosen = app->config.zone_count - 1;
+            if (chosen < 0) chosen = set->zone_count - 1;
 
             if (buckets[chosen].count < MAX_MANAGED) {
+                olds[chosen][buckets[chosen].count] = win_old[i];
                 buckets[chosen].windows[buckets[chosen].count++] = wins[i];
             }
         }
 
-        for (int z = 0; z < app->config.zone_count; z++) {
-            if (buckets[z].count == 0) continue;
-            layout_zone(app, &buckets[z], app->config.zones[z].layout, app->config.zones[z].gap);
+        for (int z = 0; z < set->zone_count; z++) {
+            ZoneBucket *b = &buckets[z];
+            if (b->count == 0) continue;
+
+            const Zone *zone = &set->zones[z];
+            ZoneLayout layout = zone_layout_for(cfg, zone, &b->area, b->count);
+            lay->zone_layouts[m][z] = layout;
+
+            Rect rects[MAX_MANAGED];
+            layout_zone(&b->area, b->count, layout, zone->gap, cfg->title_height, rects);
+            for (int i = 0; i < b->count && lay->count < MAX_MANAGED; i++) {
+                out_old[lay->count] = olds[z][i];
+                lay->items[lay->count++] = (Placement){.window = b->windows[i], .monitor = m, .zone = z, .rect = rects[i]};
+            }
         }
     }
-
-    XSync(app->dpy, False);
 }
 
-static bool grab_hotkey(App *app) {
-    const unsigned int masks[] = {0, LockMask, Mod2Mask, LockMask | Mod2Mask};
-    KeyCode code = XKeysymToKeycode(app->dpy, app->config.trigger_key);
-    if (code == 0) return false;
+static void tile_all_windows(App *app) {
+    Window wins[MAX_MANAGED];
+    static Window hidden[MAX_MANAGED];
+    int nhidden = 0;
+    int count = load_client_list(app, wins, hidden, &nhidden);
+    if (count <= 0) return;
+    count = skip_floating(app, wins, count, hidden, nhidden);
 
-    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(xerr_grab_handler);
-    g_grab_badaccess = 0;
+    if (app->monitors_dirty) refresh_monitors(app);
 
-    for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
-        XGrabKey(app->dpy,
-                 (int)code,
-                 app->config.modifier | masks[i],
-                 app->root,
-                 True,
-                 GrabModeAsync,
-                 GrabModeAsync);
+    /* Windows on other workspaces keep their placement, so switching back
+     * and retiling puts them in the same zones and slots. */
+    static Layout prev;
+    prev = app->layout;
+    for (int i = 0; i < app->parked.count && prev.count < MAX_MANAGED; i++) {
+        prev.items[prev.count++] = app->parked.items[i];
+    }
+
+    int win_mon[MAX_MANAGED];
+    const Placement *win_old[MAX_MANAGED];
+    for (int i = 0; i < count; i++) {
+        win_mon[i] = monitor_index_for_window_center(app, wins[i]);
+        win_old[i] = layout_find(&prev, wins[i]);
+    }
+
+    static const Placement *olds[MAX_MANAGED];
+    Layout *lay = &app->layout;
+    plan_layout(&app->config, app->monitors, app->monitor_count, wins, win_mon, win_old, count, &prev, lay, olds);
+    app->parked.count = 0;
+    for (int i = 0; i < prev.count; i++) {
+        if (window_in(hidden, nhidden, prev.items[i].window)) app->parked.items[app->parked.count++] = prev.items[i];
+    }
+    for (int i = 0; i < lay->count; i++) place_window(app, olds[i], &lay->items[i]);
+    for (int i = 0; i < lay->count;) {
+        int m = lay->items[i].monitor;
+        int z = lay->items[i].zone;
+        int n = 0;
+        while (i + n < lay->count && lay->items[i + n].monitor == m && lay->items[i + n].zone == z) n++;
+        raise_zone(app, &lay->items[i], n, lay->zone_layouts[m][z]);
+        i += n;
     }
 
+    app->state_dirty = true;
+    app->layout_dirty = true;
     XSync(app->dpy, False);
-    XSetErrorHandler(old_handler);
-    return g_grab_badaccess == 0;
 }
 
-static void usage(const char *prog) {
-    fprintf(stderr, "Usage: %s [-c /path/to/config]\n", prog);
+/* The layout is mirrored into _FLUXSNAP_STATE on the root window so a
+ * restarted fluxsnap can re-adopt it: a version, a count, then STATE_FIELDS
+ * cardinals per placement. */
+static void save_state(App *app) {
+    static unsigned long buf[2 + MAX_MANAGED * STATE_FIELDS];
+    const Layout *lay = &app->layout;
+    const Layout *parked = &app->parked;
+    int total = lay->count + parked->count;
+    if (total > MAX_MANAGED) total = MAX_MANAGED;
+    int n = 0;
+
+    buf[n++] = STATE_VERSION;
+    buf[n++] = (unsigned long)total;
+    for (int i = 0; i < total; i++) {
+        const Placement *p = (i < lay->count) ? &lay->items[i] : &parked->items[i - lay->count];
+        const Rect *g = p->settled.valid ? &p->settled : &(Rect){0};
+        buf[n++] = p->window;
+        buf[n++] = (unsigned long)p->monitor;
+        buf[n++] = (unsigned long)p->zone;
+        buf[n++] = (unsigned int)p->rect.x;
+        buf[n++] = (unsigned int)p->rect.y;
+        buf[n++] = (unsigned int)p->rect.width;
+        buf[n++] = (unsigned int)p->rect.height;
+        buf[n++] = (unsigned int)g->x;
+        buf[n++] = (unsigned int)g->y;
+        buf[n++] = (unsigned int)g->width;
+        buf[n++] = (unsigned int)g->height;
+    }
+
+    XChangeProperty(app->dpy, app->root, app->atom_fluxsnap_state, XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)buf, n);
+    app->state_dirty = false;
 }
 
-int main(int argc, char **argv) {
-    const char *config_path = NULL;
-    int ch;
+/* Rebuild the layout from a previous run's _FLUXSNAP_STATE and retile.
+ * Windows whose frame still has the recorded geometry are left alone. */
+static void restore_state(App *app) {
+    unsigned long *v = NULL;
+    unsigned long nitems = 0;
+    if (!root_cardinal(app, app->atom_fluxsnap_state, 2 + MAX_MANAGED * STATE_FIELDS, &v, &nitems)) return;
 
-    while ((ch = getopt(argc, argv, "c:h")) != -1) {
-        switch (ch) {
-            case 'c':
-                config_path = optarg;
-                break;
-            case 'h':
-            default:
-                usage(argv[0]);
-                return (ch == 'h') ? 0 : 1;
+    /* Any client can write the property: bound the count before using it. */
+    if (nitems < 2 || v[0] != STATE_VERSION || v[1] > MAX_MANAGED || nitems < 2 + v[1] * STATE_FIELDS) {
+        XFree(v);
+        return;
+    }
+
+    Window wins[MAX_MANAGED];
+    static Window hidden[MAX_MANAGED];
+    int nhidden = 0;
+    int count = load_client_list(app, wins, hidden, &nhidden);
+    if (app->monitors_dirty) refresh_monitors(app);
+
+    app->layout.count = 0;
+    app->parked.count = 0;
+    for (unsigned long k = 0; k < v[1]; k++) {
+        const unsigned long *e = &v[2 + k * STATE_FIELDS];
+        Window w = (Window)e[0];
+        if (e[1] >= (unsigned long)app->monitor_count) continue;
+        int m = (int)e[1];
+        if (e[2] >= (unsigned long)app->monitors[m].set->zone_count) continue;
+        int z = (int)e[2];
+
+        Layout *lay;
+        if (window_in(wins, count, w)) lay = &app->layout;
+        else if (window_in(hidden, nhidden, w)) lay = &app->parked;
+        else continue;
+        if (lay->count >= MAX_MANAGED) continue;
+
+        Placement *p = &lay->items[lay->count++];
+        *p = (Placement){0};
+        p->window = w;
+        p->frame = frame_window_for_client(app, w);
+        p->monitor = m;
+        p->zone = z;
+        p->rect = (Rect){(int)(unsigned int)e[3], (int)(unsigned int)e[4], (int)e[5], (int)e[6], true};
+        p->settled = (Rect){(int)(unsigned int)e[7], (int)(unsigned int)e[8], (int)e[9], (int)e[10], e[9] > 0};
+
+        Window root_ret;
+        int x, y;
+        unsigned int width, height, border, depth;
+        if (XGetGeometry(app->dpy, p->frame, &root_ret, &x, &y, &width, &height, &border, &depth)) {
+            p->actual = (Rect){x, y, (int)width, (int)height, true};
         }
     }
+    XFree(v);
 
-    App app = {0};
-    load_config(&app.config, config_path);
+    tile_all_windows(app);
+}
 
-    app.dpy = XOpenDisplay(NULL);
-    if (!app.dpy) {
-        fprintf(stderr, "fluxsnap: cannot open X display\n");
-        return 1;
+/* "/fluxsnap-UID-DISPLAY" with the display name made path-safe. */
+static void shared_layout_name(char *buf, size_t len, const char *display) {
+    int n = snprintf(buf, len, "/fluxsnap-%u-", (unsigned int)getuid());
+    for (const char *c = display ? display : ""; *c && n + 1 < (int)len; c++) {
+        buf[n++] = isalnum((unsigned char)*c) ? *c : '_';
+    }
+    buf[n] = '\0';
+}
+
+static void shared_layout_open(App *app) {
+    char name[128];
+    shared_layout_name(name, sizeof(name), DisplayString(app->dpy));
+
+    /* Start from a fresh segment: one left by an instance killed mid-publish
+     * could have an odd seq that every later writer would inherit. */
+    shm_unlink(name);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "fluxsnap: shm_open %s: %s\n", name, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, sizeof(SharedLayout)) != 0) {
+        close(fd);
+        return;
+    }
+    void *mem = mmap(NULL, sizeof(SharedLayout), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return;
+
+    app->shared = mem;
+    app->shared->magic = SHARED_MAGIC;
+    app->shared->version = LAYOUT_VERSION;
+}
+
+static void publish_shared(App *app) {
+    SharedLayout *sh = app->shared;
+    const Layout *lay = &app->layout;
+    uint32_t seq = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&sh->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    sh->generation = app->generation;
+    sh->fights = (uint32_t)app->fights;
+    sh->fights_damped = (uint32_t)app->fights_damped;
+    sh->floating = (uint32_t)app->floating_count;
+    sh->monitor_count = app->monitor_count;
+    for (int m = 0; m < app->monitor_count; m++) {
+        const ZoneSet *set = app->monitors[m].set;
+        sh->zone_counts[m] = set->zone_count;
+        for (int z = 0; z < set->zone_count; z++) memcpy(sh->zone_names[m][z], set->zones[z].name, 32);
+    }
+    sh->count = (uint32_t)lay->count;
+    for (int i = 0; i < lay->count; i++) {
+        const Placement *p = &lay->items[i];
+        sh->items[i] = (SharedPlacement){(uint32_t)p->window, p->monitor, p->zone,
+                                         p->rect.x, p->rect.y, p->rect.width, p->rect.height, p->fights};
+    }
+
+    atomic_store_explicit(&sh->seq, seq + 2, memory_order_release);
+}
+
+/* Publish the layout under a new generation: the seqlock segment first, then
+ * _FLUXSNAP_ZONE_NAMES and _FLUXSNAP_LAYOUT, so a PropertyNotify on the
+ * latter means both copies are current. */
+static void publish_layout(App *app) {
+    static unsigned long buf[4 + MAX_MONITORS + MAX_MANAGED * LAYOUT_FIELDS];
+    static char names[MAX_MONITORS * MAX_ZONES * 32];
+    const Layout *lay = &app->layout;
+
+    app->generation++;
+    app->layout_dirty = false;
+    if (app->shared) publish_shared(app);
+
+    int len = 0;
+    for (int m = 0; m < app->monitor_count; m++) {
+        const ZoneSet *set = app->monitors[m].set;
+        for (int z = 0; z < set->zone_count; z++) {
+            len += snprintf(names + len, sizeof(names) - (size_t)len, "%s", set->zones[z].name) + 1;
+        }
+    }
+    XChangeProperty(app->dpy, app->root, app->atom_fluxsnap_zone_names, app->atom_utf8_string, 8,
+                    PropModeReplace, (unsigned char *)names, len);
+
+    int n = 0;
+    buf[n++] = LAYOUT_VERSION;
+    buf[n++] = (unsigned long)(app->generation & 0xffffffffu);
+    buf[n++] = (unsigned long)app->monitor_count;
+    for (int m = 0; m < app->monitor_count; m++) buf[n++] = (unsigned long)app->monitors[m].set->zone_count;
+    buf[n++] = (unsigned long)lay->count;
+    for (int i = 0; i < lay->count; i++) {
+        const Placement *p = &lay->items[i];
+        buf[n++] = (unsigned long)p->monitor;
+        buf[n++] = (unsigned long)p->zone;
+        buf[n++] = p->window;
+        buf[n++] = (unsigned int)p->rect.x;
+        buf[n++] = (unsigned int)p->rect.y;
+        buf[n++] = (unsigned int)p->rect.width;
+        buf[n++] = (unsigned int)p->rect.height;
+    }
+    XChangeProperty(app->dpy, app->root, app->atom_fluxsnap_layout, XA_CARDINAL, 32,
+                    PropModeReplace, (unsigned char *)buf, n);
+}
+
+static void layout_forget(Layout *lay, Window w) {
+    for (int i = 0; i < lay->count; i++) {
+        if (lay->items[i].window != w && lay->items[i].frame != w) continue;
+        memmove(&lay->items[i], &lay->items[i + 1], (size_t)(lay->count - i - 1) * sizeof(lay->items[0]));
+        lay->count--;
+        return;
+    }
+}
+
+static int zone_index_by_name(const ZoneSet *set, const char *name) {
+    for (int z = 0; z < set->zone_count; z++) {
+        if (strcasecmp(set->zones[z].name, name) == 0) return z;
+    }
+    return -1;
+}
+
+static Window get_active_window(App *app) {
+    Atom actual_type;
+    int actual_format;
+    unsigned long nitems, bytes_after;
+    unsigned char *data = NULL;
+    Window active = None;
+
+    if (XGetWindowProperty(app->dpy, app->root, app->atom_net_active_window,
+                           0, 1, False, XA_WINDOW,
+                           &actual_type, &actual_format, &nitems, &bytes_after,
+                           &data) == Success
+        && data && actual_type == XA_WINDOW && actual_format == 32 && nitems == 1) {
+        active = *(Window *)data;
+    }
+    if (data) XFree(data);
+
+    if (active == None) {
+        int revert;
+        XGetInputFocus(app->dpy, &active, &revert);
+    }
+    return active;
+}
+
+static void activate_window(App *app, Window w) {
+    XEvent ev = {0};
+    ev.xclient.type = ClientMessage;
+    ev.xclient.window = w;
+    ev.xclient.message_type = app->atom_net_active_window;
+    ev.xclient.format = 32;
+    ev.xclient.data.l[0] = 2; /* source indication: pager */
+    ev.xclient.data.l[1] = CurrentTime;
+    XSendEvent(app->dpy, app->root, False, SubstructureRedirectMask | SubstructureNotifyMask, &ev);
+}
+
+static void swap_placements(App *app, Placement *a, Placement *b) {
+    Placement t = *a;
+    a->window = b->window;
+    a->frame = b->frame;
+    a->actual = b->actual;
+    a->fights = b->fights;
+    a->damped = b->damped;
+    b->window = t.window;
+    b->frame = t.frame;
+    b->actual = t.actual;
+    b->fights = t.fights;
+    b->damped = t.damped;
+    apply_placement(app, a);
+    apply_placement(app, b);
+}
+
+/* Where a new last slot of zone z on monitor m goes, keeping items grouped
+ * by monitor and zone. */
+static int zone_insert_index(const Layout *lay, int m, int z) {
+    for (int i = 0; i < lay->count; i++) {
+        const Placement *q = &lay->items[i];
+        if (q->monitor > m || (q->monitor == m && q->zone > z)) return i;
+    }
+    return lay->count;
+}
+
+static Placement *insert_placement(Layout *lay, const Placement *p) {
+    if (lay->count >= MAX_MANAGED) return NULL;
+    int at = zone_insert_index(lay, p->monitor, p->zone);
+    memmove(&lay->items[at + 1], &lay->items[at], (size_t)(lay->count - at) * sizeof(lay->items[0]));
+    lay->items[at] = *p;
+    lay->count++;
+    return &lay->items[at];
+}
+
+/* Re-split zone z of monitor m among the windows it holds now.  Slots that
+ * keep their rect are not touched. */
+static void resplit_zone(App *app, int m, int z) {
+    Layout *lay = &app->layout;
+    const Monitor *mon = &app->monitors[m];
+    int n;
+    int first = zone_span(lay, m, z, &n);
+    if (first < 0) {
+        lay->zone_layouts[m][z] = mon->set->zones[z].layout;
+        return;
+    }
+
+    Rect rects[MAX_MANAGED];
+    const Zone *zone = &mon->set->zones[z];
+    ZoneLayout layout = zone_layout_for(&app->config, zone, &mon->zone_rects[z], n);
+    lay->zone_layouts[m][z] = layout;
+    layout_zone(&mon->zone_rects[z], n, layout, zone->gap, app->config.title_height, rects);
+    for (int i = 0; i < n; i++) {
+        Placement *q = &lay->items[first + i];
+        if (rect_equal(&q->rect, &rects[i])) {
+            if (placement_in_place(q) || note_fight(app, q)) continue;
+        }
+        q->rect = rects[i];
+        apply_placement(app, q);
+    }
+    raise_zone(app, &lay->items[first], n, layout);
+}
+
+static bool zone_full(const App *app, int m, int z) {
+    int n;
+    int maxw = app->monitors[m].set->zones[z].max_windows;
+    zone_span(&app->layout, m, z, &n);
+    return maxw != 0 && n >= maxw;
+}
+
+/* Move p to the last slot of zone `target` on its monitor and re-split both
+ * zones; windows whose slot did not change are not touched.  A zone already
+ * at max_windows refuses the window.  Returns whether p moved. */
+static bool send_to_zone(App *app, Placement *p, int target) {
+    Layout *lay = &app->layout;
+    const Monitor *mon = &app->monitors[p->monitor];
+    if (target < 0 || target >= mon->set->zone_count || target == p->zone) return false;
+    if (zone_full(app, p->monitor, target)) return false;
+
+    int src = p->zone;
+    Placement moved = *p;
+    moved.zone = target;
+    moved.rect.valid = false;
+    layout_forget(lay, p->window);
+    insert_placement(lay, &moved);
+    resplit_zone(app, moved.monitor, target);
+    resplit_zone(app, moved.monitor, src);
+    return true;
+}
+
+/* Drop target of a snap drag.  A window already tiled on that monitor moves
+ * like send-to-zone; anything else joins the zone as its last slot. */
+static void drop_into_zone(App *app, Window client, Window frame, int m, int z) {
+    Layout *lay = &app->layout;
+    Placement *p = layout_find(lay, frame);
+    /* A refused drop snaps the window back; the drag moved its frame behind
+     * the WM's back either way. */
+    if (p && p->monitor == m) {
+        if (p->zone == z || !send_to_zone(app, p, z)) apply_placement(app, p);
+        return;
+    }
+    if (zone_full(app, m, z) || lay->count >= MAX_MANAGED) {
+        if (p) {
+            apply_placement(app, p);
+            return;
+        }
+        Window root_ret;
+        int x, y;
+        unsigned int width, height, border, depth;
+        if (XGetGeometry(app->dpy, frame, &root_ret, &x, &y, &width, &height, &border, &depth)) {
+            apply_rect(app, client, frame, (Rect){x, y, (int)width, (int)height, true});
+        }
+        return;
+    }
+
+    unfloat_window(app, client);
+    Placement np = {0};
+    int old_m = -1;
+    int old_z = -1;
+    if (p) {
+        np = *p;
+        old_m = p->monitor;
+        old_z = p->zone;
+        layout_forget(lay, p->window);
+    } else {
+        np.window = client;
+        np.frame = frame;
+    }
+    np.monitor = m;
+    np.zone = z;
+    np.rect.valid = false;
+    np.settled.valid = false;
+    if (!insert_placement(lay, &np)) return;
+
+    resplit_zone(app, m, z);
+    if (old_m >= 0) resplit_zone(app, old_m, old_z);
+}
+
+static void note_configure(App *app, Window w, Rect g, long long time_ms) {
+    Placement *p = layout_find(&app->layout, w);
+    if (!p) return;
+
+    p->actual = g;
+    /* The WM may answer one apply with several configures (frame, then
+     * decorations): settle on the last of a burst.  Only rect and settled
+     * are saved, so plain moves do not dirty the state. */
+    if (time_ms - p->applied_ms <= SETTLE_MS) {
+        if (!rect_equal(&p->settled, &g)) app->state_dirty = true;
+        p->settled = g;
+        p->applied_ms = time_ms;
+    }
+}
+
+/* Find the managed client inside a frame (the descendant with WM_STATE). */
+static Window client_for_frame(App *app, Display *dpy, Window frame, int depth) {
+    Atom actual_type;
+    int actual_format;
+    unsigned long nitems, bytes_after;
+    unsigned char *prop = NULL;
+
+    if (XGetWindowProperty(dpy, frame, app->atom_wm_state, 0, 0, False, AnyPropertyType,
+                           &actual_type, &actual_format, &nitems, &bytes_after, &prop) == Success) {
+        if (prop) XFree(prop);
+        if (actual_type != None) return frame;
+    }
+    if (depth >= 3) return None;
+
+    Window root_ret, parent_ret;
+    Window *children = NULL;
+    unsigned int nchildren = 0;
+    Window found = None;
+    if (!XQueryTree(dpy, frame, &root_ret, &parent_ret, &children, &nchildren)) return None;
+    for (unsigned int i = 0; i < nchildren && found == None; i++) {
+        found = client_for_frame(app, dpy, children[i], depth + 1);
+    }
+    if (children) XFree(children);
+    return found;
+}
+
+static void run_action(App *app, const Binding *b) {
+    if (b->action == ACTION_TILE) {
+        app->floating_count = 0;
+        tile_all_windows(app);
+        return;
+    }
+
+    /* Sending a floated window to a zone tiles it again. */
+    Window active = get_active_window(app);
+    if ((b->action == ACTION_SEND_TO_ZONE || b->action == ACTION_CYCLE_ZONE) && is_floating(app, active)) {
+        unfloat_window(app, active);
+        tile_all_windows(app);
+    }
+
+    Layout *lay = &app->layout;
+    Placement *p = layout_find(lay, active);
+    if (!p || p->monitor >= app->monitor_count) return;
+    const ZoneSet *set = app->monitors[p->monitor].set;
+
+    switch (b->action) {
+        case ACTION_FOCUS_NEXT: {
+            int idx = (int)(p - lay->items);
+            for (int step = 1; step < lay->count; step++) {
+                Placement *q = &lay->items[(idx + step) % lay->count];
+                if (q->monitor == p->monitor && q->zone == p->zone) {
+                    activate_window(app, q->window);
+                    break;
+                }
+            }
+            break;
+        }
+        case ACTION_SWAP_MASTER:
+            for (int i = 0; i < lay->count; i++) {
+                Placement *q = &lay->items[i];
+                if (q->monitor == p->monitor && q->zone == p->zone) {
+                    if (q != p) {
+                        swap_placements(app, p, q);
+                        restack_zone_of(app, q);
+                    }
+                    break;
+                }
+            }
+            break;
+        case ACTION_SEND_TO_ZONE:
+            send_to_zone(app, p, zone_index_by_name(set, b->arg));
+            break;
+        case ACTION_CYCLE_ZONE:
+            if (set->zone_count > 1) send_to_zone(app, p, (p->zone + 1) % set->zone_count);
+            break;
+        case ACTION_TILE:
+            break;
+    }
+    XFlush(app->dpy);
+}
+
+static void intern_atoms(App *app) {
+    struct {
+        const char *name;
+        Atom *slot;
+    } table[] = {
+        {"WM_STATE", &app->atom_wm_state},
+        {"_NET_WORKAREA", &app->atom_net_workarea},
+        {"_NET_CURRENT_DESKTOP", &app->atom_net_current_desktop},
+        {"_NET_CLIENT_LIST", &app->atom_net_client_list},
+        {"_NET_WM_WINDOW_TYPE", &app->atom_net_wm_window_type},
+        {"_NET_WM_WINDOW_TYPE_DOCK", &app->atom_net_wm_window_type_dock},
+        {"_NET_MOVERESIZE_WINDOW", &app->atom_net_moveresize_window},
+        {"_NET_WM_STATE", &app->atom_net_wm_state},
+        {"_NET_WM_STATE_MAXIMIZED_HORZ", &app->atom_net_wm_state_max_horz},
+        {"_NET_WM_STATE_MAXIMIZED_VERT", &app->atom_net_wm_state_max_vert},
+        {"_NET_WM_STRUT", &app->atom_net_wm_strut},
+        {"_NET_WM_STRUT_PARTIAL", &app->atom_net_wm_strut_partial},
+        {"_NET_ACTIVE_WINDOW", &app->atom_net_active_window},
+        {"_FLUXSNAP_STATE", &app->atom_fluxsnap_state},
+        {"_FLUXSNAP_LAYOUT", &app->atom_fluxsnap_layout},
+        {"_FLUXSNAP_ZONE_NAMES", &app->atom_fluxsnap_zone_names},
+        {"UTF8_STRING", &app->atom_utf8_string},
+    };
+    enum { N_ATOMS = sizeof(table) / sizeof(table[0]) };
+    char *names[N_ATOMS];
+    Atom atoms[N_ATOMS];
+
+    for (int i = 0; i < N_ATOMS; i++) names[i] = (char *)table[i].name;
+    XInternAtoms(app->dpy, names, N_ATOMS, False, atoms);
+    for (int i = 0; i < N_ATOMS; i++) *table[i].slot = atoms[i];
+}
+
+static bool grab_key(App *app, unsigned int modifier, KeySym key) {
+    const unsigned int masks[] = {0, LockMask, Mod2Mask, LockMask | Mod2Mask};
+    KeyCode code = XKeysymToKeycode(app->io_dpy, key);
+    if (code == 0) return false;
+
+    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(xerr_grab_handler);
+    g_grab_badaccess = 0;
+
+    for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+        XGrabKey(app->io_dpy,
+                 (int)code,
+                 modifier | masks[i],
+                 app->root,
+                 True,
+                 GrabModeAsync,
+                 GrabModeAsync);
+    }
+
+    XSync(app->io_dpy, False);
+    XSetErrorHandler(old_handler);
+    return g_grab_badaccess == 0;
+}
+
+static void grab_snap_button(App *app) {
+    const unsigned int masks[] = {0, LockMask, Mod2Mask, LockMask | Mod2Mask};
+    if (app->config.snap_modifier == 0) return;
+
+    int (*old_handler)(Display *, XErrorEvent *) = XSetErrorHandler(xerr_grab_handler);
+    g_grab_badaccess = 0;
+
+    for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+        XGrabButton(app->io_dpy,
+                    Button1,
+                    app->config.snap_modifier | masks[i],
+                    app->root,
+                    False,
+                    ButtonPressMask | ButtonReleaseMask | PointerMotionMask,
+                    GrabModeAsync,
+                    GrabModeAsync,
+                    None,
+                    None);
+    }
+
+    XSync(app->io_dpy, False);
+    XSetErrorHandler(old_handler);
+    if (g_grab_badaccess) fprintf(stderr, "fluxsnap: snap drag button is already grabbed by another program/window manager\n");
+}
+
+static bool grab_hotkey(App *app) {
+    return grab_key(app, app->config.modifier, app->config.trigger_key);
+}
+
+static void grab_bindings(App *app) {
+    for (int i = 0; i < app->config.binding_count; i++) {
+        const Binding *b = &app->config.bindings[i];
+        if (!grab_key(app, b->modifier, b->key)) {
+            fprintf(stderr, "fluxsnap: bind %s is already grabbed by another program/window manager\n", b->key_name);
+        }
+    }
+}
+
+static bool queue_init(MsgQueue *q) {
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->overflowed, false);
+    if (pipe(q->wake) != 0) return false;
+    for (int i = 0; i < 2; i++) {
+        fcntl(q->wake[i], F_SETFL, fcntl(q->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(q->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    return true;
+}
+
+static bool queue_push(MsgQueue *q, const Msg *m) {
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_acquire);
+    if (tail - head == QUEUE_SIZE) {
+        atomic_store_explicit(&q->overflowed, true, memory_order_relaxed);
+        return false;
+    }
+    q->items[tail & (QUEUE_SIZE - 1)] = *m;
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(MsgQueue *q, Msg *m) {
+    unsigned int head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&q->tail, memory_order_acquire);
+    if (head == tail) return false;
+    *m = q->items[head & (QUEUE_SIZE - 1)];
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return true;
+}
+
+static void queue_wake(MsgQueue *q) {
+    char c = 0;
+    while (write(q->wake[1], &c, 1) < 0 && errno == EINTR) {
+    }
+}
+
+static void queue_clear_wake(MsgQueue *q) {
+    char buf[64];
+    while (read(q->wake[0], buf, sizeof(buf)) > 0) {
+    }
+}
+
+static void publish_monitors(App *app) {
+    MonitorTable *t = malloc(sizeof(*t));
+    if (!t) return;
+    memcpy(t->monitors, app->monitors, sizeof(t->monitors));
+    t->count = app->monitor_count;
+    memcpy(t->docks, app->docks, sizeof(t->docks));
+    t->dock_count = app->dock_count;
+
+    Msg m = {.type = MSG_MONITORS, .table = t};
+    if (!queue_push(&app->to_io, &m)) {
+        free(t);
+        return;
+    }
+    queue_wake(&app->to_io);
+}
+
+/* --- layout thread --- */
+
+static void handle_msg(App *app, const Msg *m) {
+    switch (m->type) {
+        case MSG_ACTION:
+            if (m->a < 0) {
+                app->floating_count = 0; /* an explicit tile takes floated windows back */
+                app->tile_pending = true;
+            } else {
+                /* Keep order: a tile asked for earlier runs first. */
+                if (app->tile_pending && !app->dragging) {
+                    app->tile_pending = false;
+                    tile_all_windows(app);
+                }
+                run_action(app, &app->config.bindings[m->a]);
+            }
+            break;
+        case MSG_MAP:
+            if (is_normal_window(app, m->window, NULL)) {
+                app->tile_pending = true;
+            } else if (window_has_atom(app, m->window, app->atom_net_wm_window_type, app->atom_net_wm_window_type_dock)) {
+                app->monitors_dirty = true;
+            }
+            break;
+        case MSG_UNMAP:
+            if (is_known_dock(app, m->window)) app->monitors_dirty = true;
+            break;
+        case MSG_DESTROY:
+            if (layout_find(&app->layout, m->window)) {
+                layout_forget(&app->layout, m->window);
+                app->layout_dirty = true;
+            }
+            if (is_known_dock(app, m->window)) app->monitors_dirty = true;
+            break;
+        case MSG_CONFIGURE:
+            note_configure(app, m->window, m->rect, m->time_ms);
+            break;
+        case MSG_GEOMETRY:
+            app->monitors_dirty = true;
+            break;
+        case MSG_DRAG:
+            app->dragging = m->a != 0;
+            break;
+        case MSG_DROP: {
+            app->dragging = false;
+            if (m->a >= app->monitor_count || m->b >= app->monitors[m->a].set->zone_count) break;
+            const Placement *p = layout_find(&app->layout, m->window);
+            Window client = p ? p->window : client_for_frame(app, app->dpy, m->window, 0);
+            if (client != None) drop_into_zone(app, client, m->window, m->a, m->b);
+            break;
+        }
+        case MSG_MONITORS:
+            break;
+    }
+}
+
+/* Everything queued while a tile or action ran is folded into one pass:
+ * model updates are applied in order and any number of map events or tile
+ * requests collapse into a single tile at the end. */
+static void *layout_main(void *arg) {
+    App *app = arg;
+    shared_layout_open(app);
+    restore_state(app);
+
+    for (;;) {
+        Msg m;
+        bool any = false;
+        while (queue_pop(&app->to_layout, &m)) {
+            handle_msg(app, &m);
+            any = true;
+        }
+
+        if (atomic_exchange(&app->to_layout.overflowed, false)) {
+            /* Events were dropped, maybe the end of a drag: resync geometry
+             * and drag state, and retile. */
+            app->dragging = atomic_load(&app->drag_active);
+            for (int i = 0; i < app->layout.count; i++) app->layout.items[i].settled.valid = false;
+            app->monitors_dirty = true;
+            app->tile_pending = true;
+        }
+
+        if (app->tile_pending && !app->dragging) {
+            app->tile_pending = false;
+            tile_all_windows(app);
+            publish_layout(app);
+            continue;
+        }
+        if (any) {
+            if (app->layout_dirty) publish_layout(app);
+            XFlush(app->dpy);
+            continue;
+        }
+
+        if (app->monitors_dirty && !app->dragging) refresh_monitors(app);
+        if (app->layout_dirty) publish_layout(app);
+        if (app->state_dirty) save_state(app);
+        XFlush(app->dpy);
+
+        struct pollfd pfd = {app->to_layout.wake[0], POLLIN, 0};
+        if (poll(&pfd, 1, -1) > 0) queue_clear_wake(&app->to_layout);
+    }
+    return NULL;
+}
+
+/* --- I/O thread --- */
+
+static void post(App *app, Msg m) {
+    queue_push(&app->to_layout, &m);
+}
+
+static void show_preview(App *app, const Rect *r) {
+    Display *dpy = app->io_dpy;
+    if (app->preview[0] == None) {
+        XSetWindowAttributes attrs = {0};
+        attrs.override_redirect = True;
+        attrs.background_pixel = WhitePixel(dpy, app->screen);
+        for (int i = 0; i < 4; i++) {
+            app->preview[i] = XCreateWindow(dpy, app->root, 0, 0, 1, 1, 0, CopyFromParent, InputOutput,
+                                            CopyFromParent, CWOverrideRedirect | CWBackPixel, &attrs);
+        }
+    }
+
+    const int t = PREVIEW_WIDTH;
+    const Rect edges[4] = {
+        {r->x, r->y, r->width, t, true},
+        {r->x, r->y + r->height - t, r->width, t, true},
+        {r->x, r->y, t, r->height, true},
+        {r->x + r->width - t, r->y, t, r->height, true},
+    };
+    for (int i = 0; i < 4; i++) {
+        int w = edges[i].width;
+        int h = edges[i].height;
+        if (w < 1) w = 1;
+        if (h < 1) h = 1;
+        XMoveResizeWindow(dpy, app->preview[i], edges[i].x, edges[i].y, (unsigned int)w, (unsigned int)h);
+        XMapRaised(dpy, app->preview[i]);
+    }
+}
+
+static void hide_preview(App *app) {
+    if (app->preview[0] == None) return;
+    for (int i = 0; i < 4; i++) XUnmapWindow(app->io_dpy, app->preview[i]);
+}
+
+static void drag_begin(App *app, const XButtonEvent *ev) {
+    Drag *d = &app->drag;
+    if (ev->subwindow == None || !app->io_table) return;
+
+    /* Only managed frames: not the toolbar, slit, docks or popups. */
+    XWindowAttributes attrs;
+    if (!XGetWindowAttributes(app->io_dpy, ev->subwindow, &attrs) || attrs.override_redirect) return;
+    Window client = client_for_frame(app, app->io_dpy, ev->subwindow, 0);
+    if (client == None) return;
+
+    *d = (Drag){true, ev->subwindow, client, ev->x_root, ev->y_root, attrs.x, attrs.y, attrs.x, attrs.y, -1, -1};
+    atomic_store(&app->drag_active, true);
+    post(app, (Msg){.type = MSG_DRAG, .window = d->frame, .a = 1});
+}
+
+/* Pointer motion only moves the frame and, when the hovered zone changes,
+ * the outline.  Nothing here waits on the server. */
+static void drag_motion(App *app, XEvent *ev) {
+    Drag *d = &app->drag;
+    while (XCheckTypedEvent(app->io_dpy, MotionNotify, ev)) {
+    }
+
+    const XMotionEvent *mev = &ev->xmotion;
+    d->x = d->frame_x + mev->x_root - d->start_x;
+    d->y = d->frame_y + mev->y_root - d->start_y;
+    XMoveWindow(app->io_dpy, d->frame, d->x, d->y);
+
+    const MonitorTable *t = app->io_table;
+    int m = -1;
+    int z = -1;
+    for (int i = 0; i < t->count && z < 0; i++) {
+        z = zone_at(&t->monitors[i], mev->x_root, mev->y_root);
+        if (z >= 0) m = i;
+    }
+
+    if (m != d->monitor || z != d->zone) {
+        d->monitor = m;
+        d->zone = z;
+        if (z >= 0) show_preview(app, &t->monitors[m].zone_rects[z]);
+        else hide_preview(app);
+    }
+}
+
+static void drag_end(App *app) {
+    Drag *d = &app->drag;
+    hide_preview(app);
+    atomic_store(&app->drag_active, false);
+    if (d->zone >= 0) {
+        post(app, (Msg){.type = MSG_DROP, .window = d->frame, .a = d->monitor, .b = d->zone});
+    } else {
+        /* The frame was moved behind the WM's back; tell it where it ended up. */
+        XEvent mv = {0};
+        mv.xclient.type = ClientMessage;
+        mv.xclient.message_type = app->atom_net_moveresize_window;
+        mv.xclient.window = d->client;
+        mv.xclient.format = 32;
+        mv.xclient.data.l[0] = NorthWestGravity | (1L << 8) | (1L << 9);
+        mv.xclient.data.l[1] = d->x;
+        mv.xclient.data.l[2] = d->y;
+        XSendEvent(app->io_dpy, app->root, False, SubstructureRedirectMask | SubstructureNotifyMask, &mv);
+        post(app, (Msg){.type = MSG_DRAG, .window = d->frame, .a = 0});
+    }
+    d->active = false;
+}
+
+static void handle_key(App *app, const XKeyEvent *ev) {
+    const unsigned int mod_mask = ShiftMask | ControlMask | Mod1Mask | Mod4Mask;
+    KeySym sym = XkbKeycodeToKeysym(app->io_dpy, ev->keycode, 0, 0);
+
+    for (int i = 0; i < app->config.binding_count; i++) {
+        const Binding *b = &app->config.bindings[i];
+        if (sym == b->key && (ev->state & mod_mask) == b->modifier) {
+            post(app, (Msg){.type = MSG_ACTION, .a = i});
+            return;
+        }
+    }
+
+    if (sym == app->config.trigger_key && (ev->state & app->config.modifier)) {
+        post(app, (Msg){.type = MSG_ACTION, .a = -1});
+    }
+}
+
+static void handle_event(App *app, XEvent *ev) {
+    switch (ev->type) {
+        case KeyPress:
+            handle_key(app, &ev->xkey);
+            break;
+        case ButtonPress:
+            if (ev->xbutton.button == Button1) drag_begin(app, &ev->xbutton);
+            break;
+        case MotionNotify:
+            if (app->drag.active) drag_motion(app, ev);
+            break;
+        case ButtonRelease:
+            if (app->drag.active && ev->xbutton.button == Button1) drag_end(app);
+            break;
+        case DestroyNotify:
+            post(app, (Msg){.type = MSG_DESTROY, .window = ev->xdestroywindow.window});
+            break;
+        case UnmapNotify:
+            if (ev->xunmap.event == app->root) post(app, (Msg){.type = MSG_UNMAP, .window = ev->xunmap.window});
+            break;
+        case ConfigureNotify: {
+            const XConfigureEvent *c = &ev->xconfigure;
+            if (c->window == app->root) {
+                post(app, (Msg){.type = MSG_GEOMETRY});
+            } else if (c->event == app->root && !c->override_redirect) {
+                post(app, (Msg){.type = MSG_CONFIGURE,
+                                .window = c->window,
+                                .rect = {c->x, c->y, c->width, c->height, true},
+                                .time_ms = now_ms()});
+            }
+            break;
+        }
+        case PropertyNotify:
+            if (ev->xproperty.atom == app->atom_net_workarea || ev->xproperty.atom == app->atom_net_current_desktop
+                || ev->xproperty.atom == app->atom_net_wm_strut || ev->xproperty.atom == app->atom_net_wm_strut_partial) {
+                post(app, (Msg){.type = MSG_GEOMETRY});
+            }
+            break;
+        case MapNotify:
+            if (ev->xmap.event == app->root && !ev->xmap.override_redirect) {
+                post(app, (Msg){.type = MSG_MAP, .window = ev->xmap.window});
+            }
+            break;
+        default:
+#ifdef HAVE_XRANDR
+            if (app->randr_event_base && ev->type == app->randr_event_base + RRScreenChangeNotify) {
+                XRRUpdateConfiguration(ev);
+                post(app, (Msg){.type = MSG_GEOMETRY});
+            }
+#endif
+            break;
+    }
+}
+
+/* Drains the event connection as fast as the server delivers, so a key
+ * press never queues behind a slow request on the layout connection. */
+static void io_main(App *app) {
+    struct pollfd pfd[2] = {
+        {ConnectionNumber(app->io_dpy), POLLIN, 0},
+        {app->to_io.wake[0], POLLIN, 0},
+    };
+
+    for (;;) {
+        bool posted = false;
+        while (XPending(app->io_dpy)) {
+            XEvent ev;
+            XNextEvent(app->io_dpy, &ev);
+            handle_event(app, &ev);
+            posted = true;
+        }
+        if (posted) queue_wake(&app->to_layout);
+
+        Msg m;
+        while (queue_pop(&app->to_io, &m)) {
+            if (m.type != MSG_MONITORS) continue;
+            free(app->io_table);
+            app->io_table = m.table;
+            /* A strut change without a remap must still refresh the monitors. */
+            for (int i = 0; i < app->io_table->dock_count; i++) {
+                XSelectInput(app->io_dpy, app->io_table->docks[i], PropertyChangeMask);
+            }
+        }
+
+        XFlush(app->io_dpy);
+        if (QLength(app->io_dpy) > 0) continue;
+        if (poll(pfd, 2, -1) > 0 && (pfd[1].revents & POLLIN)) queue_clear_wake(&app->to_io);
+    }
+}
+
+/* -l: print the layout a running fluxsnap published, without touching X. */
+static int print_shared_layout(void) {
+    char name[128];
+    shared_layout_name(name, sizeof(name), getenv("DISPLAY"));
+
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "fluxsnap: no published layout (%s): %s\n", name, strerror(errno));
+        return 1;
+    }
+    const SharedLayout *sh = mmap(NULL, sizeof(SharedLayout), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (sh == MAP_FAILED || sh->magic != SHARED_MAGIC || sh->version != LAYOUT_VERSION) {
+        fprintf(stderr, "fluxsnap: %s is not a fluxsnap layout\n", name);
+        return 1;
+    }
+
+    static SharedLayout copy;
+    uint32_t s1 = 1;
+    uint32_t s2 = 0;
+    for (int tries = 0; tries < 1000; tries++) {
+        s1 = atomic_load_explicit(&((SharedLayout *)sh)->seq, memory_order_acquire);
+        if (!(s1 & 1)) {
+            memcpy(&copy, sh, sizeof(copy));
+            atomic_thread_fence(memory_order_acquire);
+            s2 = atomic_load_explicit(&((SharedLayout *)sh)->seq, memory_order_relaxed);
+            if (s1 == s2) break;
+        }
+        nanosleep(&(struct timespec){0, 1000000}, NULL);
+    }
+    if ((s1 & 1) || s1 != s2) {
+        fprintf(stderr, "fluxsnap: %s: no consistent copy, writer stuck or gone\n", name);
+        return 1;
+    }
+
+    printf("generation %llu\n", (unsigned long long)copy.generation);
+    printf("fights %u damped %u floating %u\n", copy.fights, copy.fights_damped, copy.floating);
+    for (uint32_t i = 0; i < copy.count && i < MAX_MANAGED; i++) {
+        const SharedPlacement *p = &copy.items[i];
+        const char *zone = (p->monitor >= 0 && p->monitor < MAX_MONITORS && p->zone >= 0 && p->zone < MAX_ZONES)
+                               ? copy.zone_names[p->monitor][p->zone]
+                               : "?";
+        printf("%d %.31s 0x%08x %d %d %d %d %d\n", p->monitor, zone, (unsigned int)p->window,
+               p->x, p->y, p->width, p->height, p->fights);
+    }
+    return 0;
+}
+
+/* Scenario lines, key=value like the config:
+ *   screen=W,H
+ *   workarea=X,Y,W,H
+ *   monitor=X,Y,W,H[,NAME]
+ *   strut=LEFT,RIGHT,TOP,BOTTOM[,8 start/end values as in _NET_WM_STRUT_PARTIAL]
+ *   window=ID,X,Y,W,H[,CLASS[,ZONE]] */
+static bool load_scenario(const char *path, Scenario *sc) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "fluxsnap: %s: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    *sc = (Scenario){0};
+    char line[512];
+    while (fgets(line, sizeof(line), f)) {
+        char *p = trim(line);
+        if (*p == '\0' || *p == '#') continue;
+
+        char *eq = strchr(p, '=');
+        if (!eq) continue;
+        *eq = '\0';
+
+        char *key = trim(p);
+        char *parts[12] = {0};
+        int n = 0;
+        for (char *tok = strtok(eq + 1, ","); tok && n < 12; tok = strtok(NULL, ",")) parts[n++] = trim(tok);
+
+        if (strcasecmp(key, "screen") == 0 && n >= 2) {
+            sc->screen_w = atoi(parts[0]);
+            sc->screen_h = atoi(parts[1]);
+        } else if (strcasecmp(key, "workarea") == 0 && n >= 4) {
+            sc->workarea = (Rect){atoi(parts[0]), atoi(parts[1]), atoi(parts[2]), atoi(parts[3]), true};
+        } else if (strcasecmp(key, "monitor") == 0 && n >= 4 && sc->monitor_count < MAX_MONITORS) {
+            int m = sc->monitor_count++;
+            sc->monitors[m] = (Rect){atoi(parts[0]), atoi(parts[1]), atoi(parts[2]), atoi(parts[3]), true};
+            if (n >= 5) snprintf(sc->monitor_names[m], sizeof(sc->monitor_names[m]), "%s", parts[4]);
+        } else if (strcasecmp(key, "strut") == 0 && n >= 4 && sc->strut_count < MAX_DOCKS) {
+            int v[12];
+            for (int i = 0; i < 12; i++) v[i] = (i < n) ? atoi(parts[i]) : 0;
+            if (n < 12) {
+                v[4] = v[6] = v[8] = v[10] = 0;
+                v[5] = v[7] = v[9] = v[11] = INT_MAX;
+            }
+            sc->struts[sc->strut_count++] = (Strut){v[0], v[1], v[2], v[3], v[4], v[5], v[6], v[7], v[8], v[9], v[10], v[11]};
+        } else if (strcasecmp(key, "window") == 0 && n >= 5 && sc->window_count < MAX_MANAGED) {
+            int w = sc->window_count++;
+            sc->windows[w] = (Window)strtoul(parts[0], NULL, 0);
+            sc->geometry[w] = (Rect){atoi(parts[1]), atoi(parts[2]), atoi(parts[3]), atoi(parts[4]), true};
+            if (n >= 6) snprintf(sc->classes[w], sizeof(sc->classes[w]), "%s", parts[5]);
+            if (n >= 7) snprintf(sc->zones[w], sizeof(sc->zones[w]), "%s", parts[6]);
+        }
+    }
+    fclose(f);
+
+    if (sc->screen_w <= 0 || sc->screen_h <= 0) {
+        for (int m = 0; m < sc->monitor_count; m++) {
+            const Rect *r = &sc->monitors[m];
+            if (r->x + r->width > sc->screen_w) sc->screen_w = r->x + r->width;
+            if (r->y + r->height > sc->screen_h) sc->screen_h = r->y + r->height;
+        }
+    }
+    if (sc->screen_w <= 0 || sc->screen_h <= 0) {
+        fprintf(stderr, "fluxsnap: %s: no screen or monitor lines\n", path);
+        return false;
+    }
+    if (!sc->workarea.valid) sc->workarea = (Rect){0, 0, sc->screen_w, sc->screen_h, true};
+    return true;
+}
+
+/* The monitor half of refresh_monitors(), fed from a scenario. */
+static int plan_monitors(const Config *cfg, const Scenario *sc, Monitor mons[MAX_MONITORS]) {
+    int n = 0;
+    for (int m = 0; m < sc->monitor_count; m++) {
+        Rect clipped = rect_intersection(&sc->workarea, &sc->monitors[m]);
+        if (!clipped.valid) continue;
+        mons[n] = (Monitor){.area = clipped};
+        memcpy(mons[n].name, sc->monitor_names[m], sizeof(mons[n].name));
+        n++;
+    }
+    if (n == 0) mons[n++] = (Monitor){.area = sc->workarea};
+
+    for (int i = 0; i < sc->strut_count; i++) {
+        for (int m = 0; m < n; m++) apply_strut_to_monitor(&mons[m].area, &sc->struts[i], sc->screen_w, sc->screen_h);
+    }
+    resolve_monitor_zones(cfg, mons, n);
+    return n;
+}
+
+/* Run one retile of sc and count the windows whose frame would be
+ * reconfigured.  Windows with a zone in the scenario form the previous
+ * layout, so sticky assignment behaves as it would on the desk. */
+static int plan_scenario(const Config *cfg, const Scenario *sc, Monitor mons[MAX_MONITORS], int *nmon,
+                         Layout *lay, bool kept[MAX_MANAGED]) {
+    static Layout prev;
+    static int win_mon[MAX_MANAGED];
+    static const Placement *win_old[MAX_MANAGED];
+    static const Placement *olds[MAX_MANAGED];
+
+    *nmon = plan_monitors(cfg, sc, mons);
+
+    prev.count = 0;
+    for (int i = 0; i < sc->window_count; i++) {
+        const Rect *g = &sc->geometry[i];
+        int m = monitor_at(mons, *nmon, g->x + g->width / 2, g->y + g->height / 2);
+        int z = sc->zones[i][0] ? zone_index_by_name(mons[m].set, sc->zones[i]) : -1;
+        win_mon[i] = m;
+        win_old[i] = NULL;
+        if (z < 0) continue;
+
+        Placement *p = &prev.items[prev.count++];
+        *p = (Placement){.window = sc->windows[i], .monitor = m, .zone = z, .rect = *g, .settled = *g, .actual = *g};
+        win_old[i] = p;
+    }
+
+    plan_layout(cfg, mons, *nmon, sc->windows, win_mon, win_old, sc->window_count, &prev, lay, olds);
+
+    /* As place_window(): new placements are always applied. */
+    int moved = 0;
+    for (int i = 0; i < lay->count; i++) {
+        kept[i] = olds[i] && rect_equal(&olds[i]->rect, &lay->items[i].rect);
+        if (!kept[i]) moved++;
+    }
+    return moved;
+}
+
+static void print_plan(const Scenario *sc, const Monitor mons[], const Layout *lay, const bool kept[], int moved) {
+    for (int i = 0; i < lay->count; i++) {
+        const Placement *p = &lay->items[i];
+        int w = 0;
+        while (w < sc->window_count && sc->windows[w] != p->window) w++;
+        printf("%d %s 0x%08lx %d %d %d %d %s %s\n", p->monitor, mons[p->monitor].set->zones[p->zone].name,
+               p->window, p->rect.x, p->rect.y, p->rect.width, p->rect.height, kept[i] ? "kept" : "moved",
+               (w < sc->window_count && sc->classes[w][0]) ? sc->classes[w] : "-");
+    }
+    printf("moved %d of %d\n", moved, lay->count);
+}
+
+/* --plan: retile each scenario offline.  With --bench N every scenario is
+ * planned N times and only the totals and the planning rate are printed. */
+static int run_plans(const Config *cfg, char **paths, int npaths, long bench) {
+    static Scenario sc;
+    static Layout lay;
+    static bool kept[MAX_MANAGED];
+    Monitor mons[MAX_MONITORS];
+    int nmon = 0;
+    long long plans = 0;
+    long long moved_total = 0;
+    double secs = 0;
+    int rc = 0;
+
+    for (int i = 0; i < npaths; i++) {
+        if (!load_scenario(paths[i], &sc)) {
+            rc = 1;
+            continue;
+        }
+        if (bench <= 0) {
+            int moved = plan_scenario(cfg, &sc, mons, &nmon, &lay, kept);
+            if (npaths > 1) printf("scenario %s\n", paths[i]);
+            print_plan(&sc, mons, &lay, kept, moved);
+            continue;
+        }
+
+        struct timespec t0, t1;
+        int moved = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (long r = 0; r < bench; r++) moved = plan_scenario(cfg, &sc, mons, &nmon, &lay, kept);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        secs += (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+        plans += bench;
+        moved_total += moved;
+        printf("%s moved %d of %d\n", paths[i], moved, lay.count);
+    }
+
+    if (bench > 0 && plans > 0) {
+        printf("%lld plans in %.3f s, %.0f plans/s, %lld windows moved\n", plans, secs,
+               secs > 0 ? (double)plans / secs : 0.0, moved_total);
+    }
+    return rc;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-c /path/to/config] [-l]\n"
+            "       %s [-c /path/to/config] --plan SCENARIO [--bench N] [SCENARIO...]\n",
+            prog, prog);
+}
+
+int main(int argc, char **argv) {
+    const char *config_path = NULL;
+    const char *plan_path = NULL;
+    long bench = 0;
+    int ch;
+
+    static const struct option longopts[] = {
+        {"plan", required_argument, NULL, 'p'},
+        {"bench", required_argument, NULL, 'b'},
+        {NULL, 0, NULL, 0},
+    };
+    while ((ch = getopt_long(argc, argv, "c:hl", longopts, NULL)) != -1) {
+        switch (ch) {
+            case 'c':
+                config_path = optarg;
+                break;
+            case 'l':
+                return print_shared_layout();
+            case 'p':
+                plan_path = optarg;
+                break;
+            case 'b':
+                bench = strtol(optarg, NULL, 10);
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return (ch == 'h') ? 0 : 1;
+        }
+    }
+
+    if (plan_path) {
+        static Config cfg;
+        int npaths = 1 + argc - optind;
+        char **paths = calloc((size_t)npaths, sizeof(*paths));
+        if (!paths) return 1;
+        paths[0] = (char *)plan_path;
+        for (int i = 1; i < npaths; i++) paths[i] = argv[optind + i - 1];
+        load_config(&cfg, config_path);
+        int rc = run_plans(&cfg, paths, npaths, bench);
+        free(paths);
+        return rc;
+    }
+
+    static App app;
+    XInitThreads();
+    load_config(&app.config, config_path);
+
+    app.dpy = XOpenDisplay(NULL);
+    app.io_dpy = XOpenDisplay(NULL);
+    if (!app.dpy || !app.io_dpy) {
+        fprintf(stderr, "fluxsnap: cannot open X display\n");
+        return 1;
+    }
+    if (!queue_init(&app.to_layout) || !queue_init(&app.to_io)) {
+        perror("fluxsnap: pipe");
+        return 1;
     }
 
     app.screen = DefaultScreen(app.dpy);
     app.root = RootWindow(app.dpy, app.screen);
-
-    app.atom_wm_state = XInternAtom(app.dpy, "WM_STATE", False);
-    app.atom_net_workarea = XInternAtom(app.dpy, "_NET_WORKAREA", False);
-    app.atom_net_current_desktop = XInternAtom(app.dpy, "_NET_CURRENT_DESKTOP", False);
-    app.atom_net_client_list = XInternAtom(app.dpy, "_NET_CLIENT_LIST", False);
-    app.atom_net_wm_window_type = XInternAtom(app.dpy, "_NET_WM_WINDOW_TYPE", False);
-    app.atom_net_wm_window_type_dock = XInternAtom(app.dpy, "_NET_WM_WINDOW_TYPE_DOCK", False);
-    app.atom_net_moveresize_window = XInternAtom(app.dpy, "_NET_MOVERESIZE_WINDOW", False);
-    app.atom_net_wm_state = XInternAtom(app.dpy, "_NET_WM_STATE", False);
-    app.atom_net_wm_state_max_horz = XInternAtom(app.dpy, "_NET_WM_STATE_MAXIMIZED_HORZ", False);
-    app.atom_net_wm_state_max_vert = XInternAtom(app.dpy, "_NET_WM_STATE_MAXIMIZED_VERT", False);
-    app.atom_net_wm_strut = XInternAtom(app.dpy, "_NET_WM_STRUT", False);
-    app.atom_net_wm_strut_partial = XInternAtom(app.dpy, "_NET_WM_STRUT_PARTIAL", False);
-
-    XSelectInput(app.dpy, app.root, SubstructureNotifyMask | KeyPressMask);
+    app.screen_w = DisplayWidth(app.dpy, app.screen);
+    app.screen_h = DisplayHeight(app.dpy, app.screen);
+
+    intern_atoms(&app);
+
+    XSetErrorHandler(xerr_ignore_handler);
+    XSelectInput(app.io_dpy, app.root, SubstructureNotifyMask | StructureNotifyMask | PropertyChangeMask | KeyPressMask);
+#ifdef HAVE_XRANDR
+    int rr_error_base, rr_major = 0, rr_minor = 0;
+    if (XRRQueryExtension(app.io_dpy, &app.randr_event_base, &rr_error_base)
+        && XRRQueryVersion(app.dpy, &rr_major, &rr_minor)) {
+        app.randr_monitors = rr_major > 1 || (rr_major == 1 && rr_minor >= 5);
+        XRRSelectInput(app.io_dpy, app.root, RRScreenChangeNotifyMask);
+    }
+#endif
+    app.monitors_dirty = true;
     if (!grab_hotkey(&app)) {
         fprintf(stderr,
                 "fluxsnap: hotkey %s+%s is already grabbed by another program/window manager\n",
@@ -830,22 +2836,20 @@ int main(int argc, char **argv) {
         fprintf(stderr, "fluxsnap: change modifier/hotkey in config or unbind the key in Fluxbox\n");
         return 1;
     }
-
-    for (;;) {
-        XEvent ev;
-        XNextEvent(app.dpy, &ev);
-
-        if (ev.type == KeyPress) {
-            KeySym sym = XkbKeycodeToKeysym(app.dpy, ev.xkey.keycode, 0, 0);
-            if (sym == app.config.trigger_key && (ev.xkey.state & app.config.modifier)) {
-                tile_all_windows(&app);
-            }
-        } else if (ev.type == MapNotify) {
-            if (ev.xmap.event == app.root && is_normal_window(&app, ev.xmap.window)) {
-                tile_all_windows(&app);
-            }
-        }
+    grab_bindings(&app);
+    grab_snap_button(&app);
+
+    pthread_attr_t attr;
+    pthread_t layout_thread;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, LAYOUT_STACK_SIZE);
+    int rc = pthread_create(&layout_thread, &attr, layout_main, &app);
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+        fprintf(stderr, "fluxsnap: cannot start layout thread: %s\n", strerror(rc));
+        return 1;
     }
 
+    io_main(&app);
     return 0;
 }